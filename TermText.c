@@ -10,6 +10,16 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // OS defines
 #define _DEFAULT_SOURCE
@@ -20,13 +30,51 @@
 #define T_TEXT_VERS "0.0.1"
 #define TERM_TAB_STOP 8
 #define TERM_QUIT_TIMES 3
+#define TERM_MMAP_THRESHOLD (1 << 20)
+#define TERM_SPAN_ROWS 1024
+#define TERM_COMMENT_STEP 4096
+#define TERM_SPLIT_CHUNK (16 << 20)
+#define TERM_SPLIT_THREADS 16
+#define POOL_MIN_BLOCK 16
+#define POOL_CLASSES 13
+#define POOL_SLAB_SIZE (1 << 21)
+#define TERM_KEY_QUEUE 1024
+#define TERM_MAX_FPS 120
+#define TERM_ESC_TIMEOUT_MS 100
+#define TERM_STATUS_MS 5000
+#define TERM_PROGRESS_MS 200
+#define TERM_AUTOSAVE_MS 0
+#define TERM_SAVE_IOV 1024
+#define TERM_SAVE_FSYNC 1
+#define TERM_SAVE_CHUNK (1 << 20)
+#define TERM_SAVE_INPLACE 1
+#define TERM_SEARCH_CHUNK (4 << 20)
+#define TERM_DFA_STATES 256
+#define TERM_RE_LITERAL 64
+#define TERM_RE_STARTS (1 << 20)
+#define TERM_UNDO_BYTES (64 << 20)
+#define TERM_JOURNAL_MS 1000
+#define TERM_JOURNAL_SUFFIX ".ttj"
+#define TERM_JOURNAL_OLD ".old"
+#define DFA_SYMBOLS 258
+#define DFA_EOL 256
+#define DFA_EOL_BOL 257
+#define TIMER_SLOTS 64
+#define TIMER_TICK_MS 16
+#define EVENT_INDEX 0
 
 // macros/data
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define ABUF_INIT \
   {               \
-    NULL, 0       \
+    NULL, 0, 0    \
   }
+#define KEY_SHIFT (1 << 16)
+#define KEY_ALT (1 << 17)
+#define KEY_CTRL (1 << 18)
+#define KEY_BASE(k) ((k) & ~(KEY_SHIFT | KEY_ALT | KEY_CTRL))
+#define ATTR_COLOUR 0x0f
+#define ATTR_REVERSE 0x80
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
@@ -41,7 +89,8 @@ enum editorKey
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_KEY
 };
 
 enum editorHighlight
@@ -58,6 +107,24 @@ enum editorHighlight
 
 // data
 
+/* Keywords compiled into a perfect hash: the seed is picked so that no two
+   keywords share a slot, so looking up a token is a single probe. */
+struct kwentry
+{
+  const char *word;
+  int len;
+  unsigned char hl;
+};
+
+struct kwtable
+{
+  struct kwentry *slots;
+  unsigned int mask;
+  unsigned int seed;
+  int maxlen;
+  int look;
+};
+
 struct editorSyntax
 {
   char *filetype;
@@ -69,21 +136,380 @@ struct editorSyntax
   char *multiline_comment_end;
 
   int flags;
+  struct kwtable *kwt;
 };
 
+struct rowspan;
+
 typedef struct erow
 {
-  int id;
+  struct rowspan *span;
+  int slot;
   int size;
   int rsize;
+  int cap;
+  int rcap;
 
   char *chars;
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  int dirty;
 
 } erow;
 
+/* A run of consecutive rows: either lines still sitting in the mapped file
+   (line >= 0) or rows that have been materialized into erows (line == -1).
+   Spans are the nodes of a treap ordered by position and augmented with the
+   row count of each subtree, so finding, inserting and removing a row is
+   O(log n). In-memory spans hold at most TERM_SPAN_ROWS rows, and each row
+   keeps its slot in rows[] so it can find itself without a scan. */
+struct rowspan
+{
+  long line;
+  int count;
+  int cap;
+  erow **rows;
+
+  int total;
+  unsigned int prio;
+  struct rowspan *left, *right, *parent;
+};
+
+/* The open multi-line comment state at the start of every
+   TERM_COMMENT_STEP-th row, worked out from the raw text. The first n are
+   valid; an edit drops those past it. */
+struct comments
+{
+  unsigned char *state;
+  int n;
+  int cap;
+};
+
+/* Row memory (erows and their chars, render and hl) comes from per-buffer
+   size classes carved out of mmap'd slabs, so closing a buffer is a handful
+   of munmaps and hands the memory straight back to the OS. Blocks above the
+   largest class are malloc'd but still tracked for the bulk release. */
+struct poolslab
+{
+  struct poolslab *next;
+};
+
+struct poolbig
+{
+  struct poolbig *prev, *next;
+  size_t size;
+};
+
+struct rowpool
+{
+  void *free[POOL_CLASSES];
+  char *cur;
+  size_t left;
+  struct poolslab *slabs;
+  struct poolbig *big;
+
+  size_t reserved;
+  size_t live;
+};
+
+struct abuf
+{
+  char *b;
+  int len;
+  int cap;
+};
+
+/* The screen as last emitted, one cell per column, and the frame being
+   drawn; refreshing sends only the difference between the two. Characters
+   and attributes are kept apart so runs of either can be copied whole. */
+struct grid
+{
+  char *ch;
+  unsigned char *attr;
+};
+
+struct frame
+{
+  struct grid cur;
+  struct grid next;
+  int rows;
+  int cols;
+
+  int bytes;
+  int writes;
+  long drawn;
+};
+
+struct input
+{
+  unsigned char buf[4096];
+  int len;
+  int keys[TERM_KEY_QUEUE];
+  int head;
+  int count;
+
+  int pasting;
+  struct abuf paste;
+};
+
+/* One-shot timers hashed by due tick into a wheel of TIMER_SLOTS slots. The
+   event loop sleeps in poll() until input, a signal (via the self-pipe) or
+   the earliest timer, so an idle editor never wakes up. */
+struct timer
+{
+  long due;
+  void (*fire)();
+  struct timer *next;
+  int armed;
+};
+
+struct events
+{
+  struct timer *slots[TIMER_SLOTS];
+  long tick;
+  int sigpipe[2];
+
+  struct timer esc;
+  struct timer status;
+  struct timer autosave;
+  struct timer journal;
+  struct timer progress;
+};
+
+/* A search pattern compiled once per query: the folded bytes, the Horspool
+   shift table, and the bytes the SIMD filter looks for at the ends. */
+struct pattern
+{
+  unsigned char *s;
+  int len;
+  int icase;
+  int word;
+  unsigned char fold[256];
+  size_t shift[256];
+
+  struct regex *re;
+  const char *err;
+};
+
+/* Regular expressions are parsed into a syntax tree and compiled into
+   Thompson NFAs, one forward and one reversed. */
+enum reNodeType
+{
+  RE_SET,
+  RE_CAT,
+  RE_ALT,
+  RE_STAR,
+  RE_PLUS,
+  RE_QUEST,
+  RE_BOL,
+  RE_EOL,
+  RE_EMPTY
+};
+
+struct renode
+{
+  int type;
+  int a, b;
+  unsigned char set[32];
+};
+
+enum nfaStateType
+{
+  NFA_SET,
+  NFA_SPLIT,
+  NFA_EPS,
+  NFA_BOL,
+  NFA_EOL,
+  NFA_MATCH
+};
+
+struct nstate
+{
+  int type;
+  int out, out1;
+  unsigned char set[32];
+};
+
+struct nfa
+{
+  struct nstate *s;
+  int n;
+  int cap;
+  int start;
+};
+
+/* A DFA built lazily over an NFA: each state is a set of NFA states, made
+   the first time a transition leads to it and cached along with the
+   transition. When TERM_DFA_STATES is reached the cache is dropped and
+   rebuilt as needed, so matching stays linear in the text. */
+struct dfa
+{
+  struct nfa *nfa;
+  int unanchored;
+  int n;
+  int cap;
+  int *trans;
+  int **sets;
+  int *setlen;
+  unsigned char *accept;
+  int *hash;
+  int hcap;
+  int start[2];
+
+  int *stack;
+  int *list;
+  unsigned int *mark;
+  unsigned int gen;
+};
+
+/* The DFAs a search needs; caches are written while matching, so every
+   thread has its own. starts holds, in order, where matches begin in the
+   line part [lo, end) last scanned back, for the searches that go on along
+   the same line; next is where the last one found was. dropped is set if
+   the cap on them made the ones furthest right go. */
+struct rematch
+{
+  struct dfa scan;
+  struct dfa back;
+  struct dfa anchor;
+
+  const char *lo;
+  const char *end;
+  const char **starts;
+  long n;
+  long cap;
+  long next;
+  int dropped;
+};
+
+/* lit is the longest run of plain chars every match contains; if prefix,
+   every match starts with it. */
+struct regex
+{
+  struct nfa fwd;
+  struct nfa rev;
+  struct pattern lit;
+  int prefix;
+  struct rematch main;
+};
+
+struct match
+{
+  int row;
+  int col;
+  int len;
+};
+
+/* A piece of the buffer as it stood when an index build started: a run of
+   mapped lines, or a copy of a span's row pointers. Each collects its own
+   matches so that the pieces can be scanned in any order. */
+struct searchseg
+{
+  int row;
+  long line;
+  int count;
+  erow **rows;
+
+  struct match *m;
+  long n;
+  long cap;
+  long first;
+};
+
+/* The match index is built by worker threads that take segments off a
+   shared counter; the last one to finish wakes the event loop through the
+   signal pipe. */
+struct search
+{
+  struct pattern pat;
+  int icase;
+  int word;
+  int regex;
+  int replace;
+  int row;
+  int col;
+  int len;
+  int active;
+  char prompt[80];
+
+  struct searchseg *segs;
+  int nsegs;
+  pthread_t tid[TERM_SPLIT_THREADS];
+  int nthreads;
+  int next;
+  int running;
+  int cancel;
+
+  long n;
+  int ready;
+};
+
+enum undoType
+{
+  UNDO_INS,
+  UNDO_DEL,
+  UNDO_ROW_INS,
+  UNDO_ROWS_INS,
+  UNDO_ROW_DEL,
+  UNDO_SET
+};
+
+/* An edit in the undo log: the header is followed by text a, then text b,
+   then the size of the whole record so that the log can be walked back.
+   a is the text inserted or deleted, or a row's old text for UNDO_SET, whose
+   new text is b. For UNDO_ROWS_INS, col is the number of rows. */
+struct undorec
+{
+  int type;
+  int start;
+  int row;
+  int col;
+  int alen;
+  int blen;
+};
+
+/* Records before pos are done, those from pos on were undone and are kept
+   for redo until the next edit. A group is the edits of one keypress; start
+   marks its first record. cx, cy and edits are where the cursor was and how
+   many edits there had been when the last key was read. */
+struct undolog
+{
+  char *log;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  size_t top;
+  int off;
+  int group;
+  int lost;
+
+  int cx, cy;
+  long edits;
+  long mark;
+  int moved;
+};
+
+/* The journal beside the file: a header naming the version of the file it
+   applies to, then the edits made since, as undo records. Records are
+   gathered in buf and written and synced in batches. */
+struct journalhead
+{
+  char magic[8];
+  long long size;
+  long long sec;
+  long long nsec;
+};
+
+struct journal
+{
+  int fd;
+  char *path;
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
 struct editorConfig
 {
   int screenrows;
@@ -92,11 +518,29 @@ struct editorConfig
   int coloff;
 
   int numrows;
-  erow *row;
+  struct rowspan *rope;
+  int dirty_from;
+  int edit_from;
+  struct comments comments;
+
+  char *map;
+  size_t maplen;
+  size_t *lineoff;
+  long nlines;
+  long rawline;
+  struct stat mapstat;
+
+  struct rowpool pool;
+  struct frame frame;
+  struct abuf out;
+  struct input in;
+  struct events ev;
+  struct search search;
+  struct undolog undo;
+  struct journal journal;
 
   char *filename;
   char statusmsg[80];
-  time_t statusmsg_time;
   int unch;
 
   int cx, cy;
@@ -108,12 +552,6 @@ struct editorConfig
 
 struct editorConfig edt;
 
-struct abuf
-{
-  char *b;
-  int len;
-};
-
 bool NORMAL_MODE = true;
 bool INSERT_MODE = false;
 
@@ -134,7 +572,7 @@ char *C_HL_keywords[] = {
     "void|", NULL};
 
 struct editorSyntax HLDB[] = {
-    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -142,25 +580,88 @@ struct editorSyntax HLDB[] = {
 // func prototypes
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorOpen(char *filename);
 void editorRefreshScreen();
+void editorCoalesceRefresh();
+void editorSave();
+void frameInvalidate();
+long editorSplitLines(const char *buf, size_t len, size_t **lineoff, long *rawline);
+int patCompile(struct pattern *p, const char *s, int icase, int word, int regex);
+long patFindLiteral(struct pattern *p, const char *buf, size_t len, size_t from);
+int patWordByte(int c);
+void patForget(struct pattern *p);
+const char *editorRowText(int at, int *len);
+void undoRecord(int type, int row, int col, const char *a, int alen, const char *b, int blen);
+void undoReset();
+void journalRecord(struct undorec *r, const char *a, const char *b);
+void journalFlush();
+void journalClose(int keep);
+erow *editorRowAt(int at);
+erow *editorRowLoaded(int at);
+erow *editorRowRendered(int at);
+int editorCommentBefore(int at);
+void editorIndexReady();
+void editorIndexStop();
+void editorIndexStart();
+long editorMatchAfter(int row, int col);
+struct match *editorMatch(long k);
+erow *editorRowPrev(erow *row);
+erow *editorRowNext(erow *row);
+int editorRowIndex(erow *row);
+struct rowspan *editorSpanFirst();
+struct rowspan *editorSpanNext(struct rowspan *n);
+size_t editorLineLen(long line);
+struct timespec editorFileMtime(struct stat *st);
+void editorUpdateSyntax(erow *row);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptText(char *prompt, void (*callback)(char *, int), int empty);
 
 // terminal
 
 void abAppend(struct abuf *ab, const char *s, int len)
 {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
-    return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  if (ab->len + len > ab->cap)
+  {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
+/* Write the buffer out and empty it, keeping its memory for the next use;
+   returns the number of write calls it took. */
+int abFlush(struct abuf *ab, int fd)
+{
+  int calls = 0;
+  int off = 0;
+  while (off < ab->len)
+  {
+    ssize_t n = write(fd, &ab->b[off], ab->len - off);
+    calls++;
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    off += n;
+  }
+  ab->len = 0;
+  return calls;
+}
+
 void abFree(struct abuf *ab)
 {
   free(ab->b);
+  ab->b = NULL;
+  ab->len = ab->cap = 0;
 }
 
 void terminate(const char *s)
@@ -168,11 +669,13 @@ void terminate(const char *s)
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
   perror(s);
+  journalFlush();
   exit(1);
 }
 
 void disableRawMode()
 {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDERR_FILENO, TCSAFLUSH, &edt.orig_termios) == -1)
   {
     terminate("tcsetattr");
@@ -197,202 +700,642 @@ void enableRawMode()
   raw.c_oflag &= ~(OPOST);
 
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
   {
     terminate("tcsetattr");
   }
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey()
+/* Escape sequences are decoded from tables: CSI/SS3 sequences ending in a
+   letter, and CSI sequences ending in '~' keyed by their first parameter. A
+   second parameter carries the modifiers, as 1 + (shift | alt << 1 | ctrl << 2). */
+struct keyseq
 {
+  char final;
+  int key;
+};
 
-  int nread;
-  char c, seq[3];
-
-  while ((nread = read(STDIN_FILENO, &c, 1)) == 0)
+const struct keyseq key_letters[] = {
+    {'A', ARROW_UP},
+    {'B', ARROW_DOWN},
+    {'C', ARROW_RIGHT},
+    {'D', ARROW_LEFT},
+    {'H', HOME_KEY},
+    {'F', END_KEY},
+    {0, 0}};
+
+const int key_tilde[] = {0, HOME_KEY, 0, DEL_KEY, END_KEY, PAGE_UP, PAGE_DOWN, HOME_KEY, END_KEY};
+
+#define KEY_TILDE_ENTRIES (int)(sizeof(key_tilde) / sizeof(key_tilde[0]))
+
+/* Decode one key from s; returns the bytes used, or 0 if s holds only the
+   start of a sequence. A CSI sequence runs through its parameter (0x30-0x3f)
+   and intermediate (0x20-0x2f) bytes to a final byte (0x40-0x7e); unknown
+   ones, and any with private parameters or intermediates, are consumed
+   whole as key -1. Sub-parameters after ':' are ignored. */
+int inputDecode(const unsigned char *s, int len, int *key)
+{
+  *key = s[0];
+  if (s[0] != '\x1b')
+    return 1;
+  if (len < 2)
+    return 0;
+  if (s[1] != '[' && s[1] != 'O')
+    return 1;
+
+  int params[2] = {0, 0};
+  int np = 0;
+  int sub = 0;
+  int other = 0;
+  for (int i = 2; i < len; i++)
   {
-    if (nread == -1 && errno != EAGAIN)
+    unsigned char c = s[i];
+    if (isdigit(c))
     {
-      terminate("read");
+      if (np < 2 && !sub && params[np] < 100000)
+        params[np] = params[np] * 10 + (c - '0');
     }
-    if (c == '\x1b')
-      break;
-  }
-
-  while (1)
-  {
-    switch (c)
+    else if (c == ';')
     {
-    case '\x1b': /* escape sequence handling */
-      if (read(STDIN_FILENO, seq, 1) == 0)
-        return '\x1b';
-      if (read(STDIN_FILENO, seq + 1, 1) == 0)
-        return '\x1b';
-
-      if (seq[0] == '[')
+      np++;
+      sub = 0;
+    }
+    else if (c == ':')
+      sub = 1;
+    else if (c >= 0x20 && c <= 0x3f)
+      other = 1;
+    else if (c >= 0x40 && c <= 0x7e)
+    {
+      *key = 0;
+      if (!other && c == '~')
       {
-        if (seq[1] >= '0' && seq[1] <= '9')
-        {
-
-          if (read(STDIN_FILENO, seq + 2, 1) == 0)
-            return '\x1b';
-          if (seq[2] == '~')
-          {
-            switch (seq[1])
-            {
-            case '3':
-              return DEL_KEY;
-            case '5':
-              return PAGE_UP;
-            case '6':
-              return PAGE_DOWN;
-            }
-          }
-        }
-        else
-        {
-          switch (seq[1])
-          {
-          case 'A':
-            return ARROW_UP;
-          case 'B':
-            return ARROW_DOWN;
-          case 'C':
-            return ARROW_RIGHT;
-          case 'D':
-            return ARROW_LEFT;
-          case 'H':
-            return HOME_KEY;
-          case 'F':
-            return END_KEY;
-          }
-        }
+        if (s[1] == '[' && params[0] < KEY_TILDE_ENTRIES)
+          *key = key_tilde[params[0]];
+        else if (s[1] == '[' && params[0] == 200)
+          *key = PASTE_KEY;
       }
-
-      /* ESC O sequences. */
-      else if (seq[0] == 'O')
+      else if (!other)
       {
-        switch (seq[1])
+        for (int j = 0; key_letters[j].final; j++)
         {
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
+          if (key_letters[j].final == c)
+            *key = key_letters[j].key;
         }
       }
-      break;
-    default:
-      return c;
+
+      int mods = params[1] > 1 ? params[1] - 1 : 0;
+      if (*key == 0)
+        *key = -1;
+      else
+        *key |= ((mods & 1) ? KEY_SHIFT : 0) | ((mods & 2) ? KEY_ALT : 0) | ((mods & 4) ? KEY_CTRL : 0);
+      return i + 1;
+    }
+    else
+    {
+      /* not part of a sequence: drop what came before and read it anew */
+      *key = -1;
+      return i;
     }
   }
+  return 0;
 }
 
-int getCursorPosition(int *rows, int *cols)
+void inputPush(struct input *in, int key)
 {
+  in->keys[(in->head + in->count++) % TERM_KEY_QUEUE] = key;
+}
 
-  char buf[32];
-  unsigned int i = 0;
-
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-    return -1;
-
-  while (i < sizeof(buf) - 1)
+/* Take the first queued key whose base is key out of the queue, leaving the
+   others in order; returns whether there was one. */
+int inputTake(struct input *in, int key)
+{
+  for (int i = 0; i < in->count; i++)
   {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
-      break;
-    if (buf[i] == 'R')
-      break;
-    i++;
+    if (KEY_BASE(in->keys[(in->head + i) % TERM_KEY_QUEUE]) != key)
+      continue;
+    for (int j = i; j + 1 < in->count; j++)
+      in->keys[(in->head + j) % TERM_KEY_QUEUE] = in->keys[(in->head + j + 1) % TERM_KEY_QUEUE];
+    in->count--;
+    return 1;
   }
-
-  buf[i] = '\0';
-
-  if (buf[0] != '\x1b' || buf[1] != '[')
-    return -1;
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-    return -1;
-
   return 0;
 }
 
-int getWindowSize(int *rows, int *cols)
+/* Collect bracketed paste text from buf[pos] up to the end marker; returns
+   the bytes used. A possible partial marker is left for the next read. Once
+   the paste is complete it is queued as one PASTE_KEY; a pause in the input
+   does not end it. */
+int inputPaste(struct input *in, int pos)
 {
-  struct winsize ws;
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+  unsigned char *s = &in->buf[pos];
+  int len = in->len - pos;
+  int take = len;
+  int found = 0;
+
+  for (int i = 0; i + 6 <= len; i++)
   {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
-      return -1;
-    return getCursorPosition(rows, cols);
+    if (s[i] == '\x1b' && !memcmp(&s[i], "\x1b[201~", 6))
+    {
+      take = i;
+      found = 1;
+      break;
+    }
   }
-  else
+  if (!found)
+    take = len > 5 ? len - 5 : 0;
+
+  abAppend(&in->paste, (char *)s, take);
+  if (found)
   {
-    *cols = ws.ws_col;
-    *rows = ws.ws_row;
+    in->pasting = 0;
+    inputPush(in, PASTE_KEY);
   }
+  return take + (found ? 6 : 0);
+}
 
-  return 0;
+/* Decode the buffered input into the key queue. A sequence cut short stays
+   in the buffer unless stale is set, in which case it was a lone ESC. Bytes
+   after a paste's end marker are decoded in the same pass. */
+void inputDecodeAll(struct input *in, int stale)
+{
+  int pos = 0;
+  while (pos < in->len && in->count < TERM_KEY_QUEUE)
+  {
+    if (in->pasting)
+    {
+      pos += inputPaste(in, pos);
+      if (in->pasting)
+        break;
+      continue;
+    }
+
+    int key;
+    int used = inputDecode(&in->buf[pos], in->len - pos, &key);
+    if (used == 0)
+    {
+      if (!stale && in->len < (int)sizeof(in->buf))
+        break;
+      key = '\x1b';
+      used = in->len - pos;
+    }
+    pos += used;
+    if (key == PASTE_KEY)
+      in->pasting = 1;
+    else if (key != -1)
+      inputPush(in, key);
+  }
+  memmove(in->buf, &in->buf[pos], in->len - pos);
+  in->len -= pos;
 }
 
-// syntax highlighting
+// events
 
-int is_separator(int c)
+long editorNowMs()
 {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
-void editorUpdateSyntax(erow *row)
+void timerCancel(struct timer *t)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (edt.syntax == NULL)
+  if (!t->armed)
     return;
+  struct timer **p = &edt.ev.slots[(t->due / TIMER_TICK_MS) % TIMER_SLOTS];
+  while (*p != t)
+    p = &(*p)->next;
+  *p = t->next;
+  t->armed = 0;
+}
 
-  char **keywords = edt.syntax->keywords;
-
-  char *scs = edt.syntax->singleline_comment_start;
-  char *mcs = edt.syntax->multiline_comment_start;
-  char *mce = edt.syntax->multiline_comment_end;
+void timerSet(struct timer *t, long ms, void (*fire)())
+{
+  timerCancel(t);
+  t->due = editorNowMs() + ms;
+  t->fire = fire;
+  struct timer **slot = &edt.ev.slots[(t->due / TIMER_TICK_MS) % TIMER_SLOTS];
+  t->next = *slot;
+  *slot = t;
+  t->armed = 1;
+}
 
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-  int scs_len = scs ? strlen(scs) : 0;
+/* Milliseconds until the earliest timer, or -1 if none is armed. */
+int timerNext(long now)
+{
+  long next = -1;
+  for (int k = 0; k < TIMER_SLOTS; k++)
+  {
+    for (struct timer *t = edt.ev.slots[k]; t; t = t->next)
+    {
+      if (next == -1 || t->due < next)
+        next = t->due;
+    }
+  }
+  if (next == -1)
+    return -1;
+  return next > now ? next - now : 0;
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->id > 0 && edt.row[row->id - 1].hl_open_comment);
+/* Fire the timers that came due, visiting only the slots of the ticks that
+   passed since the last run. */
+void timerRun(long now)
+{
+  long tick = now / TIMER_TICK_MS;
+  long from = edt.ev.tick;
+  if (from == 0 || tick - from >= TIMER_SLOTS)
+    from = tick - TIMER_SLOTS + 1;
 
-  int i = 0;
-  while (i < row->rsize)
+  for (long k = from; k <= tick; k++)
   {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment)
+    struct timer **p = &edt.ev.slots[k % TIMER_SLOTS];
+    while (*p)
     {
-      if (!strncmp(&row->render[i], scs, scs_len))
+      struct timer *t = *p;
+      if (t->due > now)
       {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
+        p = &t->next;
+        continue;
       }
+      *p = t->next;
+      t->armed = 0;
+      t->fire();
+      p = &edt.ev.slots[k % TIMER_SLOTS];
     }
+  }
+  edt.ev.tick = tick;
+}
 
-    if (mcs_len && mce_len && !in_string)
-    {
-      if (in_comment)
-      {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len))
-        {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        }
-        else
+void inputTimeout()
+{
+  inputDecodeAll(&edt.in, 1);
+}
+
+/* Bytes left once the queue has room are the start of a sequence: the rest
+   gets TERM_ESC_TIMEOUT_MS to arrive before they are read as ESC. Bytes left
+   because the queue filled up are decoded as it drains instead. */
+void inputArm(struct input *in)
+{
+  if (in->len && !in->pasting && in->count < TERM_KEY_QUEUE)
+    timerSet(&edt.ev.esc, TERM_ESC_TIMEOUT_MS, inputTimeout);
+  else
+    timerCancel(&edt.ev.esc);
+}
+
+/* Messages go when their timer fires, not when a redraw finds them old: a
+   prompt cancels the timer and stays up however long it waits. */
+void statusExpire()
+{
+  edt.statusmsg[0] = '\0';
+  editorRefreshScreen();
+}
+
+void autosaveFire()
+{
+  if (edt.unch && edt.filename)
+  {
+    editorSave();
+    editorRefreshScreen();
+  }
+}
+
+void editorSignal(int sig)
+{
+  int saved = errno;
+  unsigned char b = sig;
+  write(edt.ev.sigpipe[1], &b, 1);
+  errno = saved;
+}
+
+/* Pick up a new terminal size. Only the ioctl is used: the cursor position
+   probe would have its reply mixed in with the user's input. Terminals may
+   reflow or scroll what was on screen, so the retained frame is dropped;
+   rows keep their render and highlighting, so only the viewport and the
+   frame are redone. */
+void editorResize()
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+    return;
+  edt.screenrows = ws.ws_row > 2 ? ws.ws_row - 2 : 1;
+  edt.screencols = ws.ws_col;
+  frameInvalidate();
+  editorRefreshScreen();
+}
+
+void editorHandleSignals()
+{
+  int resized = 0;
+  unsigned char sigs[16];
+  int n;
+  while ((n = read(edt.ev.sigpipe[0], sigs, sizeof(sigs))) > 0)
+  {
+    for (int k = 0; k < n; k++)
+    {
+      if (sigs[k] == SIGTERM || sigs[k] == SIGHUP)
+      {
+        journalFlush();
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        exit(1);
+      }
+      if (sigs[k] == SIGWINCH)
+        resized = 1;
+      if (sigs[k] == EVENT_INDEX)
+        editorIndexReady();
+    }
+  }
+  if (resized)
+    editorResize();
+}
+
+void editorInitEvents()
+{
+  if (pipe(edt.ev.sigpipe) == -1)
+    terminate("pipe");
+  for (int k = 0; k < 2; k++)
+  {
+    fcntl(edt.ev.sigpipe[k], F_SETFL, O_NONBLOCK);
+    fcntl(edt.ev.sigpipe[k], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGWINCH, &sa, NULL);
+}
+
+/* Sleep until there is input, a signal or a timer due, then handle it:
+   input is read and decoded into the key queue, and an incomplete escape
+   sequence arms the ESC timeout. */
+void editorWaitEvent()
+{
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {edt.ev.sigpipe[0], POLLIN, 0}};
+  int n = poll(pfd, 2, timerNext(editorNowMs()));
+  if (n == -1 && errno != EINTR)
+    terminate("poll");
+
+  if (n > 0 && pfd[1].revents)
+    editorHandleSignals();
+  if (n > 0 && pfd[0].revents)
+  {
+    struct input *in = &edt.in;
+    int got = read(STDIN_FILENO, &in->buf[in->len], sizeof(in->buf) - in->len);
+    if (got == -1 && errno != EAGAIN && errno != EINTR)
+      terminate("read");
+    if (got == 0 && (pfd[0].revents & (POLLHUP | POLLERR)))
+      exit(1);
+    if (got > 0)
+    {
+      in->len += got;
+      inputDecodeAll(in, 0);
+    }
+    inputArm(in);
+  }
+  timerRun(editorNowMs());
+}
+
+int editorReadKey()
+{
+  struct input *in = &edt.in;
+
+  if (in->count == 0 && in->len && !edt.ev.esc.armed)
+  {
+    inputDecodeAll(in, 0);
+    inputArm(in);
+  }
+  while (in->count == 0)
+    editorWaitEvent();
+
+  int key = in->keys[in->head];
+  in->head = (in->head + 1) % TERM_KEY_QUEUE;
+  in->count--;
+  return key;
+}
+
+int getCursorPosition(int *rows, int *cols)
+{
+
+  char buf[32];
+  unsigned int i = 0;
+
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+    return -1;
+
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  while (i < sizeof(buf) - 1)
+  {
+    if (poll(&pfd, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1)
+      break;
+    if (buf[i] == 'R')
+      break;
+    i++;
+  }
+
+  buf[i] = '\0';
+
+  if (buf[0] != '\x1b' || buf[1] != '[')
+    return -1;
+  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+    return -1;
+
+  return 0;
+}
+
+int getWindowSize(int *rows, int *cols)
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+  {
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+      return -1;
+    return getCursorPosition(rows, cols);
+  }
+  else
+  {
+    *cols = ws.ws_col;
+    *rows = ws.ws_row;
+  }
+
+  return 0;
+}
+
+// syntax highlighting
+
+int is_separator(int c)
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+unsigned int kwHash(unsigned int seed, const char *s, int len)
+{
+  unsigned int h = 2166136261u ^ seed;
+  for (int i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Try to place every keyword with the given seed; fails on a collision.
+   A keyword listed twice keeps its first class. */
+int kwPlace(struct kwtable *t, char **keywords)
+{
+  memset(t->slots, 0, sizeof(struct kwentry) * (t->mask + 1));
+  for (int j = 0; keywords[j]; j++)
+  {
+    int len = strlen(keywords[j]);
+    int kw2 = keywords[j][len - 1] == '|';
+    if (kw2)
+      len--;
+    struct kwentry *e = &t->slots[kwHash(t->seed, keywords[j], len) & t->mask];
+    if (e->word)
+    {
+      if (e->len == len && !memcmp(e->word, keywords[j], len))
+        continue;
+      return 0;
+    }
+    e->word = keywords[j];
+    e->len = len;
+    e->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  return 1;
+}
+
+struct kwtable *editorCompileKeywords(struct editorSyntax *s)
+{
+  struct kwtable *t = calloc(1, sizeof(struct kwtable));
+  int n = 0;
+  for (; s->keywords[n]; n++)
+  {
+    int len = strlen(s->keywords[n]);
+    if (len > t->maxlen)
+      t->maxlen = len;
+  }
+
+  int look = t->maxlen;
+  char *delims[] = {s->singleline_comment_start, s->multiline_comment_start, s->multiline_comment_end};
+  for (int j = 0; j < 3; j++)
+  {
+    if (delims[j] && (int)strlen(delims[j]) > look)
+      look = strlen(delims[j]);
+  }
+  t->look = look + 1;
+
+  unsigned int size = 8;
+  while (size < (unsigned int)n * 2)
+    size <<= 1;
+  for (;; size <<= 1)
+  {
+    t->mask = size - 1;
+    t->slots = realloc(t->slots, sizeof(struct kwentry) * size);
+    for (t->seed = 0; t->seed < 64; t->seed++)
+    {
+      if (kwPlace(t, s->keywords))
+        return t;
+    }
+  }
+}
+
+/* Keywords are whole tokens: the run of non-separators at s is looked up.
+   Returns the keyword's length and class, or 0 if the token is not one. */
+int kwLookup(struct kwtable *t, const char *s, unsigned char *hl)
+{
+  int len = 0;
+  while (len <= t->maxlen && !is_separator(s[len]))
+    len++;
+  if (len == 0 || len > t->maxlen)
+    return 0;
+
+  struct kwentry *e = &t->slots[kwHash(t->seed, s, len) & t->mask];
+  if (e->len != len || memcmp(e->word, s, len))
+    return 0;
+  *hl = e->hl;
+  return len;
+}
+
+/* Re-highlight row->render from start onward. Highlighting resumes from the
+   last plain separator far enough before start that nothing before it could
+   have looked at the changed text. Past stop the old hl has been shifted into
+   place, so once a plain separator is plain in both versions the state has
+   re-synchronised and the rest of the row is left alone. Returns whether the
+   row's open comment state changed. */
+int editorHighlightRow(erow *row, int start, int stop)
+{
+  if (edt.syntax == NULL)
+  {
+    memset(&row->hl[start], HL_NORMAL, row->rsize - start);
+    return 0;
+  }
+
+  struct kwtable *kwt = edt.syntax->kwt;
+
+  char *scs = edt.syntax->singleline_comment_start;
+  char *mcs = edt.syntax->multiline_comment_start;
+  char *mce = edt.syntax->multiline_comment_end;
+
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  int scs_len = scs ? strlen(scs) : 0;
+
+  int look = kwt->look;
+
+  int prev_sep = 1;
+  int in_string = 0;
+  /* below a row still in the map, the state comes from the checkpoints */
+  erow *prev_row = editorRowPrev(row);
+  int in_comment;
+  if (prev_row)
+    in_comment = prev_row->hl_open_comment;
+  else
+    in_comment = mcs_len && mce_len && row->span && editorCommentBefore(editorRowIndex(row));
+
+  int i = 0;
+  for (int p = start - look; p >= 0; p--)
+  {
+    if (row->hl[p] == HL_NORMAL && is_separator(row->render[p]))
+    {
+      i = p + 1;
+      in_comment = 0;
+      break;
+    }
+  }
+
+  while (i < row->rsize)
+  {
+    char c = row->render[i];
+    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment)
+    {
+      if (!strncmp(&row->render[i], scs, scs_len))
+      {
+        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string)
+    {
+      if (in_comment)
+      {
+        row->hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len))
+        {
+          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        }
+        else
         {
           i++;
           continue;
@@ -449,36 +1392,60 @@ void editorUpdateSyntax(erow *row)
 
     if (prev_sep)
     {
-      int j;
-      for (j = 0; keywords[j]; j++)
-      {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen]))
-        {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL)
+      unsigned char kwhl;
+      int klen = kwLookup(kwt, &row->render[i], &kwhl);
+      if (klen)
       {
+        memset(&row->hl[i], kwhl, klen);
+        i += klen;
         prev_sep = 0;
         continue;
       }
     }
 
     prev_sep = is_separator(c);
+    if (prev_sep && i >= stop && row->hl[i] == HL_NORMAL)
+      return 0;
+    row->hl[i] = HL_NORMAL;
     i++;
   }
 
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
-  if (changed && row->id + 1 < edt.numrows)
-    editorUpdateSyntax(&edt.row[row->id + 1]);
+  return changed;
+}
+
+/* Highlight row and carry a changed open comment state down the rows below,
+   one at a time, until it converges with what they were highlighted with.
+   Only rows up to the end of the screen are done now; the first row past it
+   is marked dirty and the rest follows when those rows are rendered. Rows
+   past one still in the map are caught up the same way. */
+void editorUpdateSyntaxRange(erow *row, int start, int stop)
+{
+  if (!editorHighlightRow(row, start, stop))
+    return;
+
+  int at = editorRowIndex(row);
+  int last = edt.rowoff + edt.screenrows;
+  for (row = editorRowNext(row); row && !row->dirty; row = editorRowNext(row))
+  {
+    if (++at >= last)
+    {
+      row->dirty = 1;
+      if (at < edt.dirty_from)
+        edt.dirty_from = at;
+      return;
+    }
+    if (!editorHighlightRow(row, 0, row->rsize))
+      return;
+  }
+  if (row == NULL && at + 1 < edt.numrows && at + 1 < edt.dirty_from)
+    edt.dirty_from = at + 1;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+  editorUpdateSyntaxRange(row, 0, row->rsize);
 }
 
 int editorSyntaxToColour(int hl)
@@ -520,12 +1487,18 @@ void editorSelectSyntaxHighlight()
           (!is_ext && strstr(edt.filename, s->filematch[i])))
       {
         edt.syntax = s;
+        if (s->kwt == NULL)
+          s->kwt = editorCompileKeywords(s);
 
-        int filerow;
-        for (filerow = 0; filerow < edt.numrows; filerow++)
+        for (struct rowspan *sp = editorSpanFirst(); sp; sp = editorSpanNext(sp))
         {
-          editorUpdateSyntax(&edt.row[filerow]);
+          if (sp->line >= 0)
+            continue;
+          for (int k = 0; k < sp->count; k++)
+            sp->rows[k]->dirty = 1;
         }
+        edt.dirty_from = 0;
+        edt.comments.n = 0;
 
         return;
       }
@@ -534,358 +1507,3806 @@ void editorSelectSyntaxHighlight()
   }
 }
 
-// editor operations
+// row pool
 
-int editorRowCxtoRx(erow *row, int cx)
+int poolClass(size_t size)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++)
-  {
-    if (row->chars[j] == '\t')
-      rx += (TERM_TAB_STOP - 1) - (rx % TERM_TAB_STOP);
-    rx++;
-  }
+  int c = 0;
+  while (c < POOL_CLASSES && ((size_t)POOL_MIN_BLOCK << c) < size)
+    c++;
+  return c < POOL_CLASSES ? c : -1;
+}
 
-  return rx;
+size_t poolRound(size_t size)
+{
+  int c = poolClass(size);
+  return c < 0 ? size : (size_t)POOL_MIN_BLOCK << c;
 }
 
-int editorRowRxtoCx(erow *row, int rx)
+void poolFree(void *p, size_t size)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++)
-  {
-    if (row->chars[cx] == '\t')
-      cur_rx += (TERM_TAB_STOP - 1) - (cur_rx % TERM_TAB_STOP);
-    cur_rx++;
+  struct rowpool *pool = &edt.pool;
+  if (p == NULL)
+    return;
 
-    if (cur_rx > rx)
-      return cx;
+  int c = poolClass(size);
+  if (c < 0)
+  {
+    struct poolbig *b = (struct poolbig *)p - 1;
+    if (b->prev)
+      b->prev->next = b->next;
+    else
+      pool->big = b->next;
+    if (b->next)
+      b->next->prev = b->prev;
+    pool->reserved -= b->size;
+    pool->live -= b->size;
+    free(b);
+    return;
   }
 
-  return cx;
+  *(void **)p = pool->free[c];
+  pool->free[c] = p;
+  pool->live -= (size_t)POOL_MIN_BLOCK << c;
 }
 
-void editorUpdateRow(erow *row)
+void *poolAlloc(size_t size)
 {
-  int tabs = 0;
-  int j;
+  struct rowpool *pool = &edt.pool;
+  int c = poolClass(size);
 
-  for (j = 0; j < row->size; j++)
+  if (c < 0)
   {
-    if (row->chars[j] == '\t')
-      tabs++;
+    struct poolbig *b = malloc(sizeof(struct poolbig) + size);
+    if (b == NULL)
+      terminate("malloc");
+    b->size = size;
+    b->prev = NULL;
+    b->next = pool->big;
+    if (pool->big)
+      pool->big->prev = b;
+    pool->big = b;
+    pool->reserved += size;
+    pool->live += size;
+    return b + 1;
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TERM_TAB_STOP - 1) + 1);
+  size_t bsize = (size_t)POOL_MIN_BLOCK << c;
+  pool->live += bsize;
+  if (pool->free[c])
+  {
+    void *p = pool->free[c];
+    pool->free[c] = *(void **)p;
+    return p;
+  }
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++)
+  if (pool->left < bsize)
   {
-    if (row->chars[j] == '\t')
+    /* hand what is left of the old slab to the smaller classes */
+    for (int k = POOL_CLASSES - 1; k >= 0; k--)
     {
-      row->render[idx++] = ' ';
-      while (idx % TERM_TAB_STOP != 0)
-        row->render[idx++] = ' ';
+      size_t ksize = (size_t)POOL_MIN_BLOCK << k;
+      while (pool->left >= ksize)
+      {
+        *(void **)pool->cur = pool->free[k];
+        pool->free[k] = pool->cur;
+        pool->cur += ksize;
+        pool->left -= ksize;
+      }
+    }
+
+    struct poolslab *slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+      terminate("mmap");
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->cur = (char *)slab + POOL_MIN_BLOCK;
+    pool->left = POOL_SLAB_SIZE - POOL_MIN_BLOCK;
+    pool->reserved += POOL_SLAB_SIZE;
+  }
+
+  void *p = pool->cur;
+  pool->cur += bsize;
+  pool->left -= bsize;
+  return p;
+}
+
+void *poolRealloc(void *p, size_t oldsize, size_t size)
+{
+  if (p && poolRound(oldsize) == poolRound(size) && poolClass(size) >= 0)
+    return p;
+  void *n = poolAlloc(size);
+  if (p)
+  {
+    memcpy(n, p, oldsize < size ? oldsize : size);
+    poolFree(p, oldsize);
+  }
+  return n;
+}
+
+void poolRelease()
+{
+  struct rowpool *pool = &edt.pool;
+  while (pool->slabs)
+  {
+    struct poolslab *next = pool->slabs->next;
+    munmap(pool->slabs, POOL_SLAB_SIZE);
+    pool->slabs = next;
+  }
+  while (pool->big)
+  {
+    struct poolbig *next = pool->big->next;
+    free(pool->big);
+    pool->big = next;
+  }
+  memset(pool, 0, sizeof(struct rowpool));
+}
+
+// editor operations
+
+int editorRowCxtoRx(erow *row, int cx)
+{
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++)
+  {
+    if (row->chars[j] == '\t')
+      rx += (TERM_TAB_STOP - 1) - (rx % TERM_TAB_STOP);
+    rx++;
+  }
+
+  return rx;
+}
+
+int editorRowRxtoCx(erow *row, int rx)
+{
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++)
+  {
+    if (row->chars[cx] == '\t')
+      cur_rx += (TERM_TAB_STOP - 1) - (cur_rx % TERM_TAB_STOP);
+    cur_rx++;
+
+    if (cur_rx > rx)
+      return cx;
+  }
+
+  return cx;
+}
+
+void editorRowReserve(erow *row, int size)
+{
+  if (size + 1 <= row->cap)
+    return;
+  int cap = poolRound(row->cap * 2 > size + 1 ? row->cap * 2 : size + 1);
+  row->chars = poolRealloc(row->chars, row->cap, cap);
+  row->cap = cap;
+}
+
+void editorRenderReserve(erow *row, int rsize)
+{
+  if (rsize + 1 <= row->rcap)
+    return;
+  int rcap = poolRound(row->rcap * 2 > rsize + 1 ? row->rcap * 2 : rsize + 1);
+  row->render = poolRealloc(row->render, row->rcap, rcap);
+  row->hl = poolRealloc(row->hl, row->rcap, rcap);
+  row->rcap = rcap;
+}
+
+/* Expand chars[at..size) into render starting at column rx; returns rsize. */
+int editorRenderFrom(erow *row, int at, int rx)
+{
+  int idx = rx;
+  for (int j = at; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      row->render[idx++] = ' ';
+      while (idx % TERM_TAB_STOP != 0)
+        row->render[idx++] = ' ';
     }
     else
       row->render[idx++] = row->chars[j];
   }
 
   row->render[idx] = '\0';
-  row->rsize = idx;
+  return idx;
+}
+
+void editorUpdateRow(erow *row)
+{
+  int tabs = 0;
+  int j;
+
+  for (j = 0; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+
+  editorRenderReserve(row, row->size + tabs * (TERM_TAB_STOP - 1));
+  row->rsize = editorRenderFrom(row, 0, 0);
+  row->dirty = 0;
 
   editorUpdateSyntax(row);
 }
 
-void editorInsertRow(int idx, char *s, size_t len)
+/* Refresh render and hl after added chars were inserted at (or, if negative,
+   removed from) chars[at]. The render prefix before the edit is kept; if no
+   tab follows the edit, the untouched tail of hl is shifted rather than
+   recomputed so highlighting can stop as soon as it re-synchronises. A dirty
+   row is left alone: it is rebuilt in full when it is next shown. */
+void editorUpdateRowFrom(erow *row, int at, int added)
 {
-
-  if (idx < 0 || idx > edt.numrows)
+  if (row->dirty)
     return;
 
-  edt.row = realloc(edt.row, sizeof(erow) * (edt.numrows + 1));
-  memmove(&edt.row[idx + 1], &edt.row[idx], sizeof(erow) * (edt.numrows - idx));
-  for (int j = idx + 1; j <= edt.numrows; j++)
-    edt.row[j].id++;
-
-  edt.row[idx].id = idx;
-  edt.row[idx].size = len;
-  edt.row[idx].chars = malloc(len + 1);
-  memcpy(edt.row[idx].chars, s, len);
-  edt.row[idx].chars[len] = '\0';
-
-  edt.row[idx].rsize = 0;
-  edt.row[idx].render = NULL;
-  edt.row[idx].hl = NULL;
-  edt.row[idx].hl_open_comment = 0;
-  editorUpdateRow(&edt.row[idx]);
-  edt.numrows++;
-  edt.unch++;
+  int keep = row->size - at - (added > 0 ? added : 0);
+  int tabs = 0;
+  for (int j = at; j < row->size; j++)
+  {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+
+  int rx = editorRowCxtoRx(row, at);
+  editorRenderReserve(row, rx + (row->size - at) + tabs * (TERM_TAB_STOP - 1));
+
+  int stop;
+  if (tabs == 0)
+  {
+    stop = rx + (row->size - at) - keep;
+    memmove(&row->hl[stop], &row->hl[row->rsize - keep], keep);
+  }
+  row->rsize = editorRenderFrom(row, at, rx);
+  if (tabs != 0)
+    stop = row->rsize;
+
+  editorUpdateSyntaxRange(row, rx, stop);
 }
 
-void editorFreeRow(erow *row)
+// row storage
+
+int editorSpanTotal(struct rowspan *n)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  return n ? n->total : 0;
 }
 
-void editorDelRow(int idx)
+void editorSpanPull(struct rowspan *n)
 {
-  if (idx < 0 || idx >= edt.numrows)
-    return;
+  n->total = editorSpanTotal(n->left) + n->count + editorSpanTotal(n->right);
+  if (n->left)
+    n->left->parent = n;
+  if (n->right)
+    n->right->parent = n;
+}
 
-  editorFreeRow(&edt.row[idx]);
-  memmove(&edt.row[idx], &edt.row[idx + 1], sizeof(erow) * (edt.numrows - idx - 1));
-  for (int j = idx; j < edt.numrows - 1; j++)
-    edt.row[j].id--;
+void editorSpanFixup(struct rowspan *n)
+{
+  for (; n; n = n->parent)
+    editorSpanPull(n);
+}
 
-  edt.numrows--;
-  edt.unch++;
+struct rowspan *editorSpanNew(long line, int count)
+{
+  struct rowspan *n = calloc(1, sizeof(struct rowspan));
+  n->line = line;
+  n->count = count;
+  n->total = count;
+  n->prio = rand();
+  return n;
 }
 
-void editorRowInsertChar(erow *row, int idx, int c)
+struct rowspan *editorSpanMerge(struct rowspan *a, struct rowspan *b)
 {
-  if (idx < 0 || idx > row->size)
-    idx = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[idx + 1], &row->chars[idx], row->size - idx + 1);
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->prio > b->prio)
+  {
+    a->right = editorSpanMerge(a->right, b);
+    editorSpanPull(a);
+    return a;
+  }
+  b->left = editorSpanMerge(a, b->left);
+  editorSpanPull(b);
+  return b;
+}
 
-  row->size++;
-  row->chars[idx] = c;
-  editorUpdateRow(row);
-  edt.unch++;
+/* at must fall on a span boundary: *l gets the rows before it, *r the rest */
+void editorSpanSplit(struct rowspan *t, int at, struct rowspan **l, struct rowspan **r)
+{
+  if (t == NULL)
+  {
+    *l = *r = NULL;
+    return;
+  }
+  int lt = editorSpanTotal(t->left);
+  if (at <= lt)
+  {
+    editorSpanSplit(t->left, at, l, &t->left);
+    editorSpanPull(t);
+    *r = t;
+  }
+  else
+  {
+    editorSpanSplit(t->right, at - lt - t->count, &t->right, r);
+    editorSpanPull(t);
+    *l = t;
+  }
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+void editorSpanInsert(int at, struct rowspan *n)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  edt.unch++;
+  struct rowspan *l, *r;
+  editorSpanSplit(edt.rope, at, &l, &r);
+  edt.rope = editorSpanMerge(editorSpanMerge(l, n), r);
+  edt.rope->parent = NULL;
 }
 
-void editorRowDelChar(erow *row, int idx)
+void editorSpanRemove(struct rowspan *n)
 {
-  if (idx < 0 || idx >= row->size)
-    return;
-  memmove(&row->chars[idx], &row->chars[idx + 1], row->size - idx);
-  row->size--;
-  editorUpdateRow(row);
-  edt.unch++;
+  struct rowspan *p = n->parent;
+  struct rowspan *m = editorSpanMerge(n->left, n->right);
+  if (m)
+    m->parent = p;
+  if (p == NULL)
+    edt.rope = m;
+  else if (p->left == n)
+    p->left = m;
+  else
+    p->right = m;
+  editorSpanFixup(p);
+
+  free(n->rows);
+  free(n);
 }
 
-void editorInsertChar(int c)
+struct rowspan *editorSpanFind(int at, int *base)
 {
-  if (edt.cy == edt.numrows)
+  struct rowspan *n = edt.rope;
+  int b = 0;
+  while (n)
   {
-    editorInsertRow(edt.numrows, "", 0);
+    int lt = editorSpanTotal(n->left);
+    if (at < b + lt)
+      n = n->left;
+    else if (at < b + lt + n->count)
+    {
+      *base = b + lt;
+      return n;
+    }
+    else
+    {
+      b += lt + n->count;
+      n = n->right;
+    }
   }
+  *base = b;
+  return NULL;
+}
 
-  editorRowInsertChar(&edt.row[edt.cy], edt.cx, c);
-  edt.cx++;
+struct rowspan *editorSpanFirst()
+{
+  struct rowspan *n = edt.rope;
+  while (n && n->left)
+    n = n->left;
+  return n;
 }
 
-void editorInsertNewLine()
+struct rowspan *editorSpanLast()
 {
-  if (edt.cx == 0)
+  struct rowspan *n = edt.rope;
+  while (n && n->right)
+    n = n->right;
+  return n;
+}
+
+struct rowspan *editorSpanNext(struct rowspan *n)
+{
+  if (n->right)
   {
-    editorInsertRow(edt.cy, "", 0);
+    n = n->right;
+    while (n->left)
+      n = n->left;
+    return n;
   }
-  else
+  while (n->parent && n->parent->right == n)
+    n = n->parent;
+  return n->parent;
+}
+
+struct rowspan *editorSpanPrev(struct rowspan *n)
+{
+  if (n->left)
   {
-    erow *row = &edt.row[edt.cy];
-    editorInsertRow(edt.cy + 1, &row->chars[edt.cx], row->size - edt.cx);
-    row = &edt.row[edt.cy];
-    row->size = edt.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    n = n->left;
+    while (n->right)
+      n = n->right;
+    return n;
   }
+  while (n->parent && n->parent->left == n)
+    n = n->parent;
+  return n->parent;
+}
 
-  edt.cy++;
-  edt.cx = 0;
+/* point rows[from..] of an in-memory span back at it and their slots */
+void editorSpanAdopt(struct rowspan *sp, int from)
+{
+  for (int k = from; k < sp->count; k++)
+  {
+    sp->rows[k]->span = sp;
+    sp->rows[k]->slot = k;
+  }
 }
 
-void editorDelChar()
+/* drop an emptied span and re-join its neighbours if that made them contiguous */
+void editorSpanDrop(struct rowspan *sp)
 {
-  if (edt.cy == edt.numrows)
-    return;
-  if (edt.cx == 0 && edt.cy == 0)
+  struct rowspan *prev = editorSpanPrev(sp);
+  struct rowspan *next = editorSpanNext(sp);
+  editorSpanRemove(sp);
+  if (prev == NULL || next == NULL)
     return;
 
-  erow *row = &edt.row[edt.cy];
+  if (prev->line >= 0 && next->line >= 0 && prev->line + prev->count == next->line)
+  {
+    prev->count += next->count;
+    editorSpanFixup(prev);
+    editorSpanRemove(next);
+  }
+  else if (prev->line < 0 && next->line < 0 && prev->count + next->count <= TERM_SPAN_ROWS)
+  {
+    if (prev->cap < prev->count + next->count)
+    {
+      prev->cap = prev->count + next->count;
+      prev->rows = realloc(prev->rows, sizeof(erow *) * prev->cap);
+    }
+    memcpy(&prev->rows[prev->count], next->rows, sizeof(erow *) * next->count);
+    prev->count += next->count;
+    editorSpanAdopt(prev, prev->count - next->count);
+    editorSpanFixup(prev);
+    editorSpanRemove(next);
+  }
+}
 
-  if (edt.cx > 0)
+/* Split sp (whose first row is at base) so that a new span starts at
+   base + off. */
+void editorSpanBreak(struct rowspan *sp, int base, int off)
+{
+  struct rowspan *right;
+  if (sp->line >= 0)
   {
-    editorRowDelChar(row, edt.cx - 1);
-    edt.cx--;
+    right = editorSpanNew(sp->line + off, sp->count - off);
   }
   else
   {
-    edt.cx = edt.row[edt.cy - 1].size;
-    editorRowAppendString(&edt.row[edt.cy - 1], row->chars, row->size);
-    editorDelRow(edt.cy);
-    edt.cy--;
+    right = editorSpanNew(-1, sp->count - off);
+    right->cap = right->count;
+    right->rows = malloc(sizeof(erow *) * right->cap);
+    memcpy(right->rows, &sp->rows[off], sizeof(erow *) * right->count);
+    editorSpanAdopt(right, 0);
   }
+  sp->count = off;
+  editorSpanFixup(sp);
+  editorSpanInsert(base + off, right);
 }
 
-// file i/o
+void editorSpanPut(int at, erow *row)
+{
+  int base;
+  struct rowspan *sp = editorSpanFind(at, &base);
+  struct rowspan *prev = sp ? editorSpanPrev(sp) : editorSpanLast();
+
+  if (at == base && prev && prev->line < 0 && prev->count < TERM_SPAN_ROWS)
+  {
+    sp = prev;
+    base -= prev->count;
+  }
+
+  if (sp == NULL || sp->line >= 0)
+  {
+    if (sp && at > base)
+      editorSpanBreak(sp, base, at - base);
+    sp = editorSpanNew(-1, 0);
+    editorSpanInsert(at, sp);
+    base = at;
+  }
+
+  int off = at - base;
+  if (sp->count == sp->cap)
+  {
+    sp->cap = sp->cap ? sp->cap * 2 : 16;
+    sp->rows = realloc(sp->rows, sizeof(erow *) * sp->cap);
+  }
+  memmove(&sp->rows[off + 1], &sp->rows[off], sizeof(erow *) * (sp->count - off));
+  sp->rows[off] = row;
+  sp->count++;
+  editorSpanAdopt(sp, off);
+  editorSpanFixup(sp);
+
+  if (sp->count > TERM_SPAN_ROWS)
+    editorSpanBreak(sp, base, sp->count / 2);
+}
 
-char *editorRowsToString(int *buflen)
+erow *editorSpanTake(int at)
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < edt.numrows; j++)
+  int base;
+  struct rowspan *sp = editorSpanFind(at, &base);
+  int off = at - base;
+  erow *row = NULL;
+
+  if (sp->line < 0)
+  {
+    row = sp->rows[off];
+    memmove(&sp->rows[off], &sp->rows[off + 1], sizeof(erow *) * (sp->count - off - 1));
+    sp->count--;
+    editorSpanAdopt(sp, off);
+    row->span = NULL;
+  }
+  else if (off == 0)
+  {
+    sp->line++;
+    sp->count--;
+  }
+  else if (off == sp->count - 1)
+  {
+    sp->count--;
+  }
+  else
   {
-    totlen += edt.row[j].size + 1;
+    struct rowspan *right = editorSpanNew(sp->line + off + 1, sp->count - off - 1);
+    sp->count = off;
+    editorSpanFixup(sp);
+    editorSpanInsert(at, right);
+    return NULL;
   }
-  *buflen = totlen;
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < edt.numrows; j++)
+  editorSpanFixup(sp);
+  if (sp->count == 0)
+    editorSpanDrop(sp);
+  return row;
+}
+
+int editorRowIndex(erow *row)
+{
+  struct rowspan *n = row->span;
+  int at = editorSpanTotal(n->left) + row->slot;
+  for (; n->parent; n = n->parent)
   {
-    memcpy(p, edt.row[j].chars, edt.row[j].size);
-    p += edt.row[j].size;
-    *p = '\n';
-    p++;
+    if (n == n->parent->right)
+      at += editorSpanTotal(n->parent->left) + n->parent->count;
   }
+  return at;
+}
 
-  return buf;
+/* Neighbours are found through the owning span rather than a stored row
+   number, so inserting or deleting rows never has to touch the rows after. */
+erow *editorRowPrev(erow *row)
+{
+  if (row->span == NULL)
+    return NULL;
+  int k = row->slot;
+  if (k > 0)
+    return row->span->rows[k - 1];
+  struct rowspan *sp = editorSpanPrev(row->span);
+  return (sp && sp->line < 0) ? sp->rows[sp->count - 1] : NULL;
 }
 
-void editorSave()
+erow *editorRowNext(erow *row)
 {
-  if (edt.filename == NULL)
+  if (row->span == NULL)
+    return NULL;
+  int k = row->slot;
+  if (k + 1 < row->span->count)
+    return row->span->rows[k + 1];
+  struct rowspan *sp = editorSpanNext(row->span);
+  return (sp && sp->line < 0) ? sp->rows[0] : NULL;
+}
+
+erow *editorNewRow(char *s, size_t len)
+{
+  erow *row = poolAlloc(sizeof(erow));
+  row->span = NULL;
+  row->slot = 0;
+  row->size = len;
+  row->cap = poolRound(len + 1);
+  row->chars = poolAlloc(row->cap);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->rcap = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open_comment = 0;
+  row->dirty = 1;
+  return row;
+}
+
+erow *editorRowLoaded(int at)
+{
+  if (at < 0 || at >= edt.numrows)
+    return NULL;
+  int base;
+  struct rowspan *sp = editorSpanFind(at, &base);
+  if (sp->line >= 0)
+    return NULL;
+  return sp->rows[at - base];
+}
+
+erow *editorRowLoad(int at)
+{
+  int base;
+  long line = editorSpanFind(at, &base)->line;
+  line += at - base;
+
+  editorSpanTake(at);
+  erow *row = editorNewRow(&edt.map[edt.lineoff[line]], editorLineLen(line));
+  editorSpanPut(at, row);
+  if (at < edt.dirty_from)
+    edt.dirty_from = at;
+
+  /* a loaded row below was highlighted from the checkpoints, not this one */
+  erow *next = editorRowNext(row);
+  if (next)
+    next->dirty = 1;
+  return row;
+}
+
+erow *editorRowAt(int at)
+{
+  erow *row = editorRowLoaded(at);
+  if (row || at < 0 || at >= edt.numrows)
+    return row;
+  return editorRowLoad(at);
+}
+
+/* The open comment state after a row's text, given the state before it:
+   the part of editorHighlightRow that carries over to the next row, run on
+   the raw chars so rows still in the map are stepped over without loading.
+   Tabs only widen the render, so the chars give the same answer. */
+int editorCommentScan(const char *s, int len, int in_comment)
+{
+  char *scs = edt.syntax->singleline_comment_start;
+  char *mcs = edt.syntax->multiline_comment_start;
+  char *mce = edt.syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  int strings = edt.syntax->flags & HL_HIGHLIGHT_STRINGS;
+  if (!mcs_len || !mce_len)
+    return 0;
+
+  int in_string = 0;
+  int i = 0;
+  while (i < len)
   {
+    if (in_comment)
+    {
+      const char *e = memchr(&s[i], mce[0], len - i);
+      if (e == NULL)
+        break;
+      i = e - s;
+      if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len))
+      {
+        i += mce_len;
+        in_comment = 0;
+      }
+      else
+        i++;
+      continue;
+    }
+    if (in_string)
+    {
+      if (s[i] == '\\' && i + 1 < len)
+      {
+        i += 2;
+        continue;
+      }
+      if (s[i] == in_string)
+        in_string = 0;
+      i++;
+      continue;
+    }
 
-    edt.filename = editorPrompt("Save as: %s", NULL);
-    if (edt.filename == NULL)
+    char c = s[i];
+    if (scs_len && c == scs[0] && i + scs_len <= len && !memcmp(&s[i], scs, scs_len))
+      break;
+    if (c == mcs[0] && i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len))
     {
-      editorSetStatusMessage("Save Aborted");
-      return;
+      i += mcs_len;
+      in_comment = 1;
+      continue;
     }
+    if (strings && (c == '"' || c == '\''))
+      in_string = c;
+    i++;
+  }
+  return in_comment;
+}
 
-    editorSelectSyntaxHighlight();
+/* Step the state from the start of row from to the start of row to, a span
+   at a time. */
+int editorCommentRun(int from, int to, int in_comment)
+{
+  int base;
+  struct rowspan *sp = editorSpanFind(from, &base);
+  for (int at = from; at < to; sp = editorSpanNext(sp))
+  {
+    int end = base + sp->count < to ? base + sp->count : to;
+    for (; at < end; at++)
+    {
+      if (sp->line >= 0)
+      {
+        long line = sp->line + at - base;
+        in_comment = editorCommentScan(&edt.map[edt.lineoff[line]], editorLineLen(line), in_comment);
+      }
+      else
+      {
+        erow *r = sp->rows[at - base];
+        in_comment = editorCommentScan(r->chars, r->size, in_comment);
+      }
+    }
+    base += sp->count;
+  }
+  return in_comment;
+}
+
+/* The open comment state at the start of row at: from the nearest
+   checkpoint, filling in those still missing on the way. */
+int editorCommentBefore(int at)
+{
+  struct comments *c = &edt.comments;
+  int k = at / TERM_COMMENT_STEP;
+  if (c->n == 0)
+  {
+    if (c->cap == 0)
+    {
+      c->cap = 16;
+      c->state = malloc(c->cap);
+    }
+    c->state[0] = 0;
+    c->n = 1;
+  }
+  for (; c->n <= k; c->n++)
+  {
+    if (c->n == c->cap)
+    {
+      c->cap *= 2;
+      c->state = realloc(c->state, c->cap);
+    }
+    int from = (c->n - 1) * TERM_COMMENT_STEP;
+    c->state[c->n] = editorCommentRun(from, from + TERM_COMMENT_STEP, c->state[c->n - 1]);
+  }
+  return editorCommentRun(k * TERM_COMMENT_STEP, at, c->state[k]);
+}
+
+/* Rows are rendered and highlighted only when they are about to be shown.
+   A row's highlighting depends on the open comment state of the row above,
+   so with multi-line comments the loaded rows from dirty_from (above which
+   every row is either up to date or still in the map) down to at are
+   brought up to date first, in order. Rows in the map are skipped, and the
+   first loaded row past them is re-highlighted from the checkpoints, so
+   jumping far ahead loads nothing in between. */
+erow *editorRowRendered(int at)
+{
+  erow *row = editorRowAt(at);
+  if (row == NULL)
+    return NULL;
+
+  if (edt.syntax == NULL || edt.syntax->multiline_comment_start == NULL)
+  {
+    if (row->dirty)
+      editorUpdateRow(row);
+    return row;
+  }
+
+  int gap = edt.dirty_from > 0 && editorRowLoaded(edt.dirty_from - 1) == NULL;
+  while (edt.dirty_from <= at)
+  {
+    int base;
+    struct rowspan *sp = editorSpanFind(edt.dirty_from, &base);
+    int end = base + sp->count <= at ? base + sp->count : at + 1;
+    if (sp->line >= 0)
+    {
+      edt.dirty_from = end;
+      gap = 1;
+      continue;
+    }
+    for (; edt.dirty_from < end; edt.dirty_from++, gap = 0)
+    {
+      erow *r = sp->rows[edt.dirty_from - base];
+      if (r->dirty)
+        editorUpdateRow(r);
+      else if (gap)
+        editorUpdateSyntax(r);
+    }
+  }
+  return row;
+}
+
+/* Rows above edit_from are still, byte for byte, the lines of the file as it
+   was last loaded or saved. */
+void editorTouch(int at)
+{
+  if (at < edt.edit_from)
+    edt.edit_from = at;
+  edt.unch++;
+  patForget(&edt.search.pat);
+  if (edt.comments.n > at / TERM_COMMENT_STEP + 1)
+    edt.comments.n = at / TERM_COMMENT_STEP + 1;
+}
+
+void editorInsertRow(int idx, char *s, size_t len)
+{
+
+  if (idx < 0 || idx > edt.numrows)
+    return;
+
+  undoRecord(UNDO_ROW_INS, idx, 0, s, len, NULL, 0);
+  erow *row = editorNewRow(s, len);
+  editorSpanPut(idx, row);
+  edt.numrows++;
+
+  /* start from the open comment state the row below was highlighted with, so
+     it is re-highlighted only if this row turns out to change it */
+  erow *prev_row = editorRowPrev(row);
+  row->hl_open_comment = prev_row ? prev_row->hl_open_comment : 0;
+  erow *next_row = editorRowNext(row);
+  if (prev_row == NULL && next_row)
+    next_row->dirty = 1;
+  if (idx < edt.dirty_from)
+    edt.dirty_from = idx;
+  editorTouch(idx);
+}
+
+/* Insert the newline separated lines of buf as rows starting at at, building
+   whole spans at a time; returns the number of rows inserted. */
+int editorInsertRows(int at, char *buf, size_t len)
+{
+  if (at < 0 || at > edt.numrows)
+    return 0;
+
+  int base;
+  struct rowspan *sp = editorSpanFind(at, &base);
+  if (sp && at > base)
+    editorSpanBreak(sp, base, at - base);
+
+  erow *prev_row = editorRowLoaded(at - 1);
+  int open_comment = prev_row ? prev_row->hl_open_comment : 0;
+
+  int n = 0;
+  struct rowspan *chunk = NULL;
+  size_t pos = 0;
+  while (pos < len)
+  {
+    char *nl = memchr(&buf[pos], '\n', len - pos);
+    size_t end = nl ? (size_t)(nl - buf) : len;
+    size_t linelen = end - pos;
+    while (linelen > 0 && buf[pos + linelen - 1] == '\r')
+      linelen--;
+
+    if (chunk == NULL)
+    {
+      chunk = editorSpanNew(-1, 0);
+      chunk->cap = TERM_SPAN_ROWS;
+      chunk->rows = malloc(sizeof(erow *) * chunk->cap);
+    }
+    erow *row = editorNewRow(&buf[pos], linelen);
+    row->hl_open_comment = open_comment;
+    row->span = chunk;
+    row->slot = chunk->count;
+    chunk->rows[chunk->count++] = row;
+    n++;
+
+    if (chunk->count == TERM_SPAN_ROWS || end == len || end + 1 == len)
+    {
+      editorSpanPull(chunk);
+      editorSpanInsert(at + n - chunk->count, chunk);
+      chunk = NULL;
+    }
+    pos = end + 1;
+  }
+  edt.numrows += n;
+
+  if (n)
+  {
+    erow *next_row = editorRowLoaded(at + n);
+    if (prev_row == NULL && next_row)
+      next_row->dirty = 1;
+    undoRecord(UNDO_ROWS_INS, at, n, buf, len, NULL, 0);
+    if (at < edt.dirty_from)
+      edt.dirty_from = at;
+    editorTouch(at);
+  }
+  return n;
+}
+
+void editorFreeRow(erow *row)
+{
+  poolFree(row->render, row->rcap);
+  poolFree(row->chars, row->cap);
+  poolFree(row->hl, row->rcap);
+  poolFree(row, sizeof(erow));
+}
+
+void editorFreeSpans(struct rowspan *n)
+{
+  if (n == NULL)
+    return;
+  editorFreeSpans(n->left);
+  editorFreeSpans(n->right);
+  free(n->rows);
+  free(n);
+}
+
+/* Drop the whole buffer. Rows are not freed one by one: their memory goes
+   back with the pool. */
+void editorCloseBuffer()
+{
+  editorIndexStop();
+  journalClose(0);
+  editorFreeSpans(edt.rope);
+  edt.rope = NULL;
+  poolRelease();
+
+  if (edt.map)
+    munmap(edt.map, edt.maplen);
+  free(edt.lineoff);
+  edt.map = NULL;
+  edt.maplen = 0;
+  edt.lineoff = NULL;
+  edt.nlines = 0;
+  edt.rawline = 0;
+
+  edt.numrows = 0;
+  edt.dirty_from = 0;
+  edt.edit_from = 0;
+  edt.comments.n = 0;
+  edt.cx = edt.cy = edt.rx = 0;
+  edt.rowoff = edt.coloff = 0;
+  edt.unch = 0;
+  undoReset();
+}
+
+void editorDelRow(int idx)
+{
+  if (idx < 0 || idx >= edt.numrows)
+    return;
+
+  int len;
+  const char *text = editorRowText(idx, &len);
+  undoRecord(UNDO_ROW_DEL, idx, 0, text, len, NULL, 0);
+  erow *row = editorSpanTake(idx);
+  edt.numrows--;
+
+  /* the row that moves up was highlighted against this row's state */
+  erow *prev_row = editorRowLoaded(idx - 1);
+  erow *next_row = editorRowLoaded(idx);
+  int open_comment = prev_row ? prev_row->hl_open_comment : 0;
+  if (next_row && (row == NULL || open_comment != row->hl_open_comment))
+    next_row->dirty = 1;
+
+  if (row)
+    editorFreeRow(row);
+  if (idx < edt.dirty_from)
+    edt.dirty_from = idx;
+  editorTouch(idx);
+}
+
+void editorRowInsertChar(erow *row, int idx, int c)
+{
+  if (idx < 0 || idx > row->size)
+    idx = row->size;
+  editorRowReserve(row, row->size + 1);
+  memmove(&row->chars[idx + 1], &row->chars[idx], row->size - idx + 1);
+
+  row->size++;
+  row->chars[idx] = c;
+  editorUpdateRowFrom(row, idx, 1);
+  int at = editorRowIndex(row);
+  undoRecord(UNDO_INS, at, idx, &row->chars[idx], 1, NULL, 0);
+  editorTouch(at);
+}
+
+void editorRowInsertString(erow *row, int at, char *s, size_t len)
+{
+  if (len == 0)
+    return;
+  editorRowReserve(row, row->size + len);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorUpdateRowFrom(row, at, len);
+  int idx = editorRowIndex(row);
+  undoRecord(UNDO_INS, idx, at, s, len, NULL, 0);
+  editorTouch(idx);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+  editorRowInsertString(row, row->size, s, len);
+}
+
+/* Remove len chars of row from at on. */
+void editorRowDelRange(erow *row, int at, int len)
+{
+  if (len <= 0)
+    return;
+  int idx = editorRowIndex(row);
+  undoRecord(UNDO_DEL, idx, at, &row->chars[at], len, NULL, 0);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRowFrom(row, at, -len);
+  editorTouch(idx);
+}
+
+void editorRowDelChar(erow *row, int idx)
+{
+  if (idx < 0 || idx >= row->size)
+    return;
+  editorRowDelRange(row, idx, 1);
+}
+
+/* Give row the text s, as undo and redo of a replace do. */
+void editorRowSet(erow *row, const char *s, int len)
+{
+  int idx = editorRowIndex(row);
+  undoRecord(UNDO_SET, idx, 0, row->chars, row->size, s, len);
+  editorRowReserve(row, len);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  row->dirty = 1;
+  if (idx < edt.dirty_from)
+    edt.dirty_from = idx;
+  editorTouch(idx);
+}
+
+void editorInsertChar(int c)
+{
+  if (edt.cy == edt.numrows)
+  {
+    editorInsertRow(edt.numrows, "", 0);
+  }
+
+  editorRowInsertChar(editorRowAt(edt.cy), edt.cx, c);
+  edt.cx++;
+}
+
+void editorInsertNewLine()
+{
+  if (edt.cx == 0)
+  {
+    editorInsertRow(edt.cy, "", 0);
+  }
+  else
+  {
+    erow *row = editorRowAt(edt.cy);
+    int removed = row->size - edt.cx;
+    editorInsertRow(edt.cy + 1, &row->chars[edt.cx], removed);
+    editorRowDelRange(row, edt.cx, removed);
+  }
+
+  edt.cy++;
+  edt.cx = 0;
+}
+
+/* Insert text at the cursor as one edit: the cursor row is split once and
+   everything after the first line goes in with a single bulk insert. */
+void editorInsertText(char *s, size_t len)
+{
+  if (len == 0)
+    return;
+  if (edt.cy == edt.numrows)
+    editorInsertRow(edt.numrows, "", 0);
+
+  erow *row = editorRowAt(edt.cy);
+  int tail = row->size - edt.cx;
+  char *buf = malloc(len + tail + 1);
+  size_t n = 0;
+  size_t first = len, last = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = s[i];
+    if (c == '\r')
+    {
+      c = '\n';
+      if (i + 1 < len && s[i + 1] == '\n')
+        i++;
+    }
+    if (c == '\n')
+    {
+      if (first == len)
+        first = n;
+      last = n + 1;
+    }
+    buf[n++] = c;
+  }
+
+  if (first == len)
+  {
+    editorRowInsertString(row, edt.cx, buf, n);
+    edt.cx += n;
+    free(buf);
+    return;
+  }
+
+  memcpy(&buf[n], &row->chars[edt.cx], tail);
+  buf[n + tail] = '\n';
+  editorRowDelRange(row, edt.cx, tail);
+  editorRowInsertString(row, edt.cx, buf, first);
+
+  edt.cy += editorInsertRows(edt.cy + 1, &buf[first + 1], n + tail - first);
+  edt.cx = n - last;
+  free(buf);
+}
+
+void editorDelChar()
+{
+  if (edt.cy == edt.numrows)
+    return;
+  if (edt.cx == 0 && edt.cy == 0)
+    return;
+
+  erow *row = editorRowAt(edt.cy);
+
+  if (edt.cx > 0)
+  {
+    editorRowDelChar(row, edt.cx - 1);
+    edt.cx--;
+  }
+  else
+  {
+    erow *prev_row = editorRowAt(edt.cy - 1);
+    edt.cx = prev_row->size;
+    editorRowAppendString(prev_row, row->chars, row->size);
+    editorDelRow(edt.cy);
+    edt.cy--;
+  }
+}
+
+// undo
+
+/* Edits are logged as they are made, as the text they insert or remove, so
+   undoing one costs as much as the edit did. The log is capped at
+   TERM_UNDO_BYTES: the oldest groups go first, and a group too big to keep
+   is not logged at all, taking the history before it with it. */
+
+void undoReset()
+{
+  struct undolog *u = &edt.undo;
+  free(u->log);
+  u->log = NULL;
+  u->len = u->cap = u->pos = u->top = 0;
+  u->group = 1;
+  u->lost = 0;
+  u->moved = 1;
+}
+
+/* Start a new group for the key just read. If the key before it moved the
+   cursor without editing, the next edit must not join the earlier typing. */
+void undoKey()
+{
+  struct undolog *u = &edt.undo;
+  if (u->edits == u->mark && (edt.cx != u->cx || edt.cy != u->cy))
+    u->moved = 1;
+  u->mark = u->edits;
+  u->cx = edt.cx;
+  u->cy = edt.cy;
+  u->group = 1;
+}
+
+/* The record ending at end. */
+char *undoPrev(size_t end, struct undorec *r)
+{
+  int size;
+  memcpy(&size, &edt.undo.log[end - sizeof(int)], sizeof(int));
+  memcpy(r, &edt.undo.log[end - size], sizeof(*r));
+  return &edt.undo.log[end - size];
+}
+
+size_t undoSize(struct undorec *r)
+{
+  return sizeof(*r) + r->alen + r->blen + sizeof(int);
+}
+
+/* Fold a typed or deleted char into the last record, when it is a lone
+   insert or delete right next to it, so a run of typing undoes at once. */
+int undoCoalesce(int type, int row, int col, const char *a, int alen)
+{
+  struct undolog *u = &edt.undo;
+  if (alen != 1 || (type != UNDO_INS && type != UNDO_DEL) || u->moved || u->len == 0 ||
+      u->len != u->pos || u->len + 1 > TERM_UNDO_BYTES)
+    return 0;
+
+  /* the last record must be a group of its own */
+  struct undorec r;
+  size_t q = undoPrev(u->len, &r) - u->log;
+  if (!r.start || r.type != type || r.row != row)
+    return 0;
+  int prepend = 0;
+  if (type == UNDO_INS && col == r.col + r.alen)
+    prepend = 0;
+  else if (type == UNDO_DEL && col == r.col)
+    prepend = 0;
+  else if (type == UNDO_DEL && col + 1 == r.col)
+    prepend = 1;
+  else
+    return 0;
+
+  if (u->len + 1 > u->cap)
+  {
+    u->cap *= 2;
+    u->log = realloc(u->log, u->cap);
+  }
+  char *text = &u->log[q + sizeof(r)];
+  if (prepend)
+  {
+    memmove(&text[1], text, r.alen);
+    text[0] = a[0];
+    r.col = col;
+  }
+  else
+    text[r.alen] = a[0];
+  r.alen++;
+  int size = undoSize(&r);
+  memcpy(&u->log[q], &r, sizeof(r));
+  memcpy(&u->log[q + size - sizeof(int)], &size, sizeof(int));
+  u->len = u->pos = q + size;
+  u->top = q;
+  return 1;
+}
+
+/* Drop whole groups from the front of the log until size more bytes fit
+   with a quarter of the cap to spare. Returns 0 if the current group would
+   have to go too. */
+int undoTrim(size_t size)
+{
+  struct undolog *u = &edt.undo;
+  size_t keep = TERM_UNDO_BYTES / 4 * 3;
+  size_t cut = 0;
+  while (cut < u->len && u->len - cut + size > keep)
+  {
+    struct undorec r;
+    memcpy(&r, &u->log[cut], sizeof(r));
+    cut += undoSize(&r);
+    while (cut < u->len)
+    {
+      memcpy(&r, &u->log[cut], sizeof(r));
+      if (r.start)
+        break;
+      cut += undoSize(&r);
+    }
+  }
+  if (cut > u->top)
+    return 0;
+  memmove(u->log, &u->log[cut], u->len - cut);
+  u->len -= cut;
+  u->pos = u->len;
+  u->top -= cut;
+  return 1;
+}
+
+void undoRecord(int type, int row, int col, const char *a, int alen, const char *b, int blen)
+{
+  struct undolog *u = &edt.undo;
+  struct undorec r = {type, 0, row, col, alen, blen};
+  journalRecord(&r, a, b);
+  if (u->off)
+    return;
+  u->edits++;
+  int start = u->group;
+  u->group = 0;
+  if (start)
+    u->lost = 0;
+  if (u->lost)
+    return;
+  if (start && undoCoalesce(type, row, col, a, alen))
+    return;
+  u->moved = 0;
+
+  /* a new edit drops what was undone */
+  u->len = u->pos;
+  if (start)
+    u->top = u->len;
+  r.start = start;
+  size_t size = undoSize(&r);
+  if (u->len + size > TERM_UNDO_BYTES && (size > TERM_UNDO_BYTES || !undoTrim(size)))
+  {
+    undoReset();
+    u->group = 0;
+    u->lost = 1;
+    return;
+  }
+
+  if (u->len + size > u->cap)
+  {
+    u->cap = u->len + size > u->cap * 2 ? u->len + size : u->cap * 2;
+    u->log = realloc(u->log, u->cap);
+  }
+  char *p = &u->log[u->len];
+  memcpy(p, &r, sizeof(r));
+  if (alen)
+    memcpy(p + sizeof(r), a, alen);
+  if (blen)
+    memcpy(p + sizeof(r) + alen, b, blen);
+  int isize = size;
+  memcpy(p + size - sizeof(int), &isize, sizeof(int));
+  u->len += size;
+  u->pos = u->len;
+}
+
+/* Apply record r, whose text follows it at p, or its inverse, and leave
+   the cursor where it took place. */
+void undoApply(struct undorec *r, char *p, int undo)
+{
+  char *a = p + sizeof(*r);
+  char *b = a + r->alen;
+  edt.cy = r->row;
+  edt.cx = 0;
+  switch (r->type)
+  {
+  case UNDO_INS:
+  case UNDO_DEL:
+    if ((r->type == UNDO_INS) == undo)
+      editorRowDelRange(editorRowAt(r->row), r->col, r->alen);
+    else
+      editorRowInsertString(editorRowAt(r->row), r->col, a, r->alen);
+    edt.cx = r->col + (undo || r->type == UNDO_DEL ? 0 : r->alen);
+    break;
+  case UNDO_ROW_INS:
+  case UNDO_ROW_DEL:
+    if ((r->type == UNDO_ROW_INS) == undo)
+      editorDelRow(r->row);
+    else
+      editorInsertRow(r->row, a, r->alen);
+    break;
+  case UNDO_ROWS_INS:
+    if (undo)
+      for (int i = 0; i < r->col; i++)
+        editorDelRow(r->row);
+    else
+      editorInsertRows(r->row, a, r->alen);
+    break;
+  case UNDO_SET:
+    editorRowSet(editorRowAt(r->row), undo ? a : b, undo ? r->alen : r->blen);
+    break;
+  }
+}
+
+void undoCursor()
+{
+  if (edt.cy > edt.numrows)
+    edt.cy = edt.numrows;
+  int len = edt.cy < edt.numrows ? editorRowAt(edt.cy)->size : 0;
+  if (edt.cx > len)
+    edt.cx = len;
+}
+
+/* Undo the last group of edits. */
+void editorUndo()
+{
+  struct undolog *u = &edt.undo;
+  if (u->pos == 0)
+  {
+    editorSetStatusMessage(u->lost ? "Undo history was too big to keep" : "Already at oldest change");
+    return;
+  }
+  u->off++;
+  struct undorec r;
+  do
+  {
+    char *p = undoPrev(u->pos, &r);
+    u->pos = p - u->log;
+    undoApply(&r, p, 1);
+  } while (!r.start && u->pos > 0);
+  u->off--;
+  u->group = 1;
+  undoCursor();
+}
+
+/* Redo the next undone group. */
+void editorRedo()
+{
+  struct undolog *u = &edt.undo;
+  if (u->pos == u->len)
+  {
+    editorSetStatusMessage("Already at newest change");
+    return;
+  }
+  u->off++;
+  struct undorec r;
+  do
+  {
+    char *p = &u->log[u->pos];
+    memcpy(&r, p, sizeof(r));
+    u->pos += undoSize(&r);
+    undoApply(&r, p, 0);
+    if (u->pos < u->len)
+      memcpy(&r, &u->log[u->pos], sizeof(r));
+  } while (u->pos < u->len && !r.start);
+  u->off--;
+  u->group = 1;
+  undoCursor();
+}
+
+// journal
+
+/* Edits reach the journal as they are made and the disk once every
+   TERM_JOURNAL_MS, in one write and one sync, so a crash loses at most that
+   much and the buffer is never written out for it. */
+
+char *journalPath(const char *filename)
+{
+  size_t len = strlen(filename);
+  char *path = malloc(len + sizeof(TERM_JOURNAL_SUFFIX));
+  memcpy(path, filename, len);
+  memcpy(&path[len], TERM_JOURNAL_SUFFIX, sizeof(TERM_JOURNAL_SUFFIX));
+  return path;
+}
+
+void journalHead(struct journalhead *h, struct stat *st)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "TTJRNL1", 8);
+  h->size = st->st_size;
+  struct timespec mtime = editorFileMtime(st);
+  h->sec = mtime.tv_sec;
+  h->nsec = mtime.tv_nsec;
+}
+
+/* Get the journal to the disk itself. macOS fsync stops at the drive's
+   cache, F_FULLFSYNC goes through it where the file system allows. */
+int journalSync(int fd)
+{
+#ifdef F_FULLFSYNC
+  if (fcntl(fd, F_FULLFSYNC) == 0)
+    return 0;
+  return fsync(fd);
+#else
+  return fdatasync(fd);
+#endif
+}
+
+/* Stop journaling; the journal is removed unless kept for recovery. */
+void journalClose(int keep)
+{
+  struct journal *j = &edt.journal;
+  timerCancel(&edt.ev.journal);
+  if (j->fd >= 0)
+  {
+    close(j->fd);
+    if (!keep)
+      unlink(j->path);
+  }
+  free(j->path);
+  free(j->buf);
+  j->fd = -1;
+  j->path = NULL;
+  j->buf = NULL;
+  j->len = j->cap = 0;
+}
+
+void journalRecord(struct undorec *r, const char *a, const char *b)
+{
+  struct journal *j = &edt.journal;
+  if (j->fd < 0)
+    return;
+  size_t size = undoSize(r);
+  if (j->len + size > j->cap)
+  {
+    j->cap = j->len + size > j->cap * 2 ? j->len + size : j->cap * 2;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  char *p = &j->buf[j->len];
+  memcpy(p, r, sizeof(*r));
+  if (r->alen)
+    memcpy(p + sizeof(*r), a, r->alen);
+  if (r->blen)
+    memcpy(p + sizeof(*r) + r->alen, b, r->blen);
+  int isize = size;
+  memcpy(p + size - sizeof(int), &isize, sizeof(int));
+  j->len += size;
+  if (!edt.ev.journal.armed)
+    timerSet(&edt.ev.journal, TERM_JOURNAL_MS, journalFlush);
+}
+
+/* Write out the records gathered since the last batch and sync them. */
+void journalFlush()
+{
+  struct journal *j = &edt.journal;
+  if (j->fd < 0 || j->len == 0)
+    return;
+  size_t off = 0;
+  while (off < j->len)
+  {
+    ssize_t n = write(j->fd, &j->buf[off], j->len - off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  if (off < j->len || journalSync(j->fd) == -1)
+  {
+    editorSetStatusMessage("Journal write failed: %s", strerror(errno));
+    journalClose(1);
+    return;
+  }
+  j->len = 0;
+}
+
+/* Start the journal over for the file as it is on disk now. */
+void journalReset()
+{
+  struct journal *j = &edt.journal;
+  struct stat st;
+  if (!TERM_JOURNAL_MS || edt.filename == NULL || stat(edt.filename, &st) == -1)
+    return;
+  if (j->fd < 0)
+  {
+    j->path = journalPath(edt.filename);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  }
+  struct journalhead h;
+  journalHead(&h, &st);
+  timerCancel(&edt.ev.journal);
+  j->len = 0;
+  if (j->fd == -1 || ftruncate(j->fd, 0) == -1 || write(j->fd, &h, sizeof(h)) != sizeof(h))
+  {
+    editorSetStatusMessage("Can't write journal %s: %s", j->path, strerror(errno));
+    journalClose(1);
+  }
+}
+
+/* Whether record r, with its text at a, can be applied to the buffer: the
+   text it removes must be there. */
+int journalFits(struct undorec *r, const char *a)
+{
+  if (r->row < 0 || r->row > edt.numrows || r->col < 0)
+    return 0;
+  if (r->type == UNDO_ROW_INS || r->type == UNDO_ROWS_INS)
+    return 1;
+  if (r->row == edt.numrows)
+    return 0;
+  int len;
+  const char *text = editorRowText(r->row, &len);
+  switch (r->type)
+  {
+  case UNDO_INS:
+    return r->col <= len;
+  case UNDO_DEL:
+    return r->alen <= len - r->col && memcmp(&text[r->col], a, r->alen) == 0;
+  case UNDO_ROW_DEL:
+  case UNDO_SET:
+    return r->alen == len && memcmp(text, a, len) == 0;
+  }
+  return 0;
+}
+
+/* Apply the records in buf until one that is cut short or does not fit,
+   as when the editor died in the middle of a write. Returns the number
+   applied and the length they take in valid. */
+long journalReplay(char *buf, size_t len, size_t *valid)
+{
+  long n = 0;
+  size_t pos = 0;
+  edt.undo.off++;
+  while (len - pos >= sizeof(struct undorec) + sizeof(int))
+  {
+    struct undorec r;
+    memcpy(&r, &buf[pos], sizeof(r));
+    if (r.alen < 0 || r.blen < 0 ||
+        (size_t)r.alen + r.blen > len - pos - sizeof(r) - sizeof(int))
+      break;
+    size_t size = undoSize(&r);
+    int isize;
+    memcpy(&isize, &buf[pos + size - sizeof(int)], sizeof(int));
+    if (isize != (int)size || !journalFits(&r, &buf[pos + sizeof(r)]))
+      break;
+    undoApply(&r, &buf[pos], 0);
+    pos += size;
+    n++;
+  }
+  edt.undo.off--;
+  *valid = pos;
+  return n;
+}
+
+/* Once a file is loaded: replay the journal an editor that did not exit
+   cleanly left for this version of it, and carry on journaling after it. */
+void journalOpen()
+{
+  struct journal *j = &edt.journal;
+  if (!TERM_JOURNAL_MS || edt.filename == NULL)
+    return;
+  char *path = journalPath(edt.filename);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+  {
+    free(path);
+    journalReset();
+    return;
+  }
+
+  struct stat st, jst;
+  struct journalhead h, want;
+  char *buf = NULL;
+  size_t len = 0;
+  int ok = stat(edt.filename, &st) == 0 && fstat(fd, &jst) == 0 &&
+           read(fd, &h, sizeof(h)) == sizeof(h);
+  if (ok)
+  {
+    journalHead(&want, &st);
+    ok = memcmp(&h, &want, sizeof(h)) == 0;
+  }
+  if (ok)
+  {
+    len = jst.st_size - sizeof(h);
+    buf = malloc(len ? len : 1);
+    size_t got = 0;
+    ssize_t n;
+    while (got < len && (n = read(fd, &buf[got], len - got)) > 0)
+      got += n;
+    len = got;
+  }
+  /* a journal for another version of the file may still hold the only
+     copy of someone's edits: it is moved aside, never dropped */
+  if (!ok)
+  {
+    close(fd);
+    size_t size = strlen(path) + sizeof(TERM_JOURNAL_OLD) + 12;
+    char *old = malloc(size);
+    snprintf(old, size, "%s" TERM_JOURNAL_OLD, path);
+    for (int k = 2; access(old, F_OK) == 0; k++)
+      snprintf(old, size, "%s" TERM_JOURNAL_OLD ".%d", path, k);
+    if (rename(path, old) == 0)
+    {
+      editorSetStatusMessage("Journal not for this version of the file, moved to %s", old);
+      journalReset();
+    }
+    else
+      editorSetStatusMessage("Journal %s not for this version of the file, not journaling: %s", path,
+                             strerror(errno));
+    free(old);
+    free(path);
+    return;
+  }
+
+  size_t valid;
+  long n = journalReplay(buf, len, &valid);
+  free(buf);
+  ftruncate(fd, sizeof(h) + valid);
+  fcntl(fd, F_SETFL, O_APPEND);
+  j->fd = fd;
+  j->path = path;
+  if (n)
+  {
+    undoCursor();
+    editorSetStatusMessage("Recovered %ld edits from %s, Ctrl-S keeps them", n, path);
+  }
+}
+
+// file i/o
+
+/* macOS names the modification time st_mtimespec */
+struct timespec editorFileMtime(struct stat *st)
+{
+#ifdef __APPLE__
+  return st->st_mtimespec;
+#else
+  return st->st_mtim;
+#endif
+}
+
+/* Extend fd to from + len, with the blocks allocated where the system can do
+   that; returns 0 or an errno. */
+int editorFileReserve(int fd, off_t from, off_t len)
+{
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+  return posix_fallocate(fd, from, len);
+#else
+  return ftruncate(fd, from + len) == -1 ? errno : 0;
+#endif
+}
+
+size_t editorLineLen(long line)
+{
+  size_t start = edt.lineoff[line];
+  size_t len = edt.lineoff[line + 1] - start;
+  while (len > 0 && (edt.map[start + len - 1] == '\n' || edt.map[start + len - 1] == '\r'))
+    len--;
+  return len;
+}
+
+/* Rows are saved straight from where they live, gathered into writev
+   batches; nothing the size of the file is ever built in memory. */
+struct savebuf
+{
+  int fd;
+  off_t off;
+  struct iovec iov[TERM_SAVE_IOV];
+  int n;
+  size_t total;
+  int err;
+};
+
+int saveFlush(struct savebuf *sb)
+{
+  struct iovec *v = sb->iov;
+  int n = sb->n;
+  while (n > 0 && sb->err == 0)
+  {
+    ssize_t w = pwritev(sb->fd, v, n, sb->off);
+    if (w == -1)
+    {
+      if (errno != EINTR)
+        sb->err = errno;
+      continue;
+    }
+    sb->total += w;
+    sb->off += w;
+    while (n > 0 && (size_t)w >= v->iov_len)
+    {
+      w -= v->iov_len;
+      v++;
+      n--;
+    }
+    if (n > 0)
+    {
+      v->iov_base = (char *)v->iov_base + w;
+      v->iov_len -= w;
+    }
+  }
+  sb->n = 0;
+  return sb->err == 0;
+}
+
+void savePush(struct savebuf *sb, const char *p, size_t len)
+{
+  if (len == 0)
+    return;
+  if (sb->n == TERM_SAVE_IOV)
+    saveFlush(sb);
+  sb->iov[sb->n].iov_base = (void *)p;
+  sb->iov[sb->n].iov_len = len;
+  sb->n++;
+}
+
+/* Stream every row out. A run of mapped lines that each end in a bare '\n'
+   is already in saved form, so it goes out as one piece of the map. */
+int editorWriteRows(struct savebuf *sb)
+{
+  for (struct rowspan *sp = editorSpanFirst(); sp; sp = editorSpanNext(sp))
+  {
+    if (sp->line < 0)
+    {
+      for (int k = 0; k < sp->count; k++)
+      {
+        savePush(sb, sp->rows[k]->chars, sp->rows[k]->size);
+        savePush(sb, "\n", 1);
+      }
+      continue;
+    }
+
+    long end = sp->line + sp->count;
+    long run = sp->line;
+    for (long l = sp->line; l < end; l++)
+    {
+      size_t a = edt.lineoff[l], b = edt.lineoff[l + 1];
+      if (b > a && edt.map[b - 1] == '\n' && (b - a < 2 || edt.map[b - 2] != '\r'))
+        continue;
+      savePush(sb, &edt.map[edt.lineoff[run]], a - edt.lineoff[run]);
+      savePush(sb, &edt.map[a], editorLineLen(l));
+      savePush(sb, "\n", 1);
+      run = l + 1;
+    }
+    savePush(sb, &edt.map[edt.lineoff[run]], edt.lineoff[end] - edt.lineoff[run]);
+  }
+  return saveFlush(sb);
+}
+
+/* After a save the file on disk holds exactly the document: map it in place
+   of the old one and point every mapped span at its new lines, so the old
+   file's blocks are released and the next save can start from this one. A
+   NULL lineoff means the new map has to be indexed. */
+void editorRebase(char *map, size_t len, size_t *lineoff)
+{
+  long rawline;
+  if (lineoff == NULL)
+    editorSplitLines(map, len, &lineoff, &rawline);
+
+  munmap(edt.map, edt.maplen);
+  free(edt.lineoff);
+  edt.map = map;
+  edt.maplen = len;
+  edt.lineoff = lineoff;
+  edt.nlines = edt.numrows;
+  edt.rawline = edt.numrows;
+
+  long at = 0;
+  struct rowspan *prev = NULL;
+  struct rowspan *sp = editorSpanFirst();
+  while (sp)
+  {
+    struct rowspan *next = editorSpanNext(sp);
+    if (sp->line >= 0)
+      sp->line = at;
+    at += sp->count;
+    if (sp->line >= 0 && prev && prev->line >= 0)
+    {
+      prev->count += sp->count;
+      editorSpanFixup(prev);
+      editorSpanRemove(sp);
+    }
+    else
+      prev = sp;
+    sp = next;
+  }
+}
+
+/* Rows [from, from + count) of sp, going to dst in the saved file. Mapped
+   pieces come from src in that same file. */
+struct savepiece
+{
+  struct rowspan *sp;
+  int from;
+  int count;
+  size_t src;
+  size_t dst;
+  size_t len;
+};
+
+int savePwrite(int fd, const char *p, size_t len, off_t off)
+{
+  while (len > 0)
+  {
+    ssize_t w = pwrite(fd, p, len, off);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    p += w;
+    len -= w;
+    off += w;
+  }
+  return 0;
+}
+
+/* Mapped pieces are copied through buf, front to back when they move towards
+   the start of the file and back to front when they move the other way, so
+   no byte is overwritten before it has been read. */
+int savePiece(struct savebuf *sb, struct savepiece *pc, char *buf)
+{
+  if (pc->sp->line < 0)
+  {
+    sb->off = pc->dst;
+    for (int k = pc->from; k < pc->from + pc->count; k++)
+    {
+      savePush(sb, pc->sp->rows[k]->chars, pc->sp->rows[k]->size);
+      savePush(sb, "\n", 1);
+    }
+    return saveFlush(sb) ? 0 : sb->err;
+  }
+
+  for (size_t done = 0; done < pc->len && pc->dst != pc->src;)
+  {
+    size_t n = pc->len - done < TERM_SAVE_CHUNK ? pc->len - done : TERM_SAVE_CHUNK;
+    size_t at = pc->dst < pc->src ? done : pc->len - done - n;
+    memcpy(buf, &edt.map[pc->src + at], n);
+    int err = savePwrite(sb->fd, buf, n, pc->dst + at);
+    if (err)
+      return err;
+    sb->total += n;
+    done += n;
+  }
+  return 0;
+}
+
+/* Rewrite the mapped file in place from the first edited row on: the prefix
+   is never touched and mapped runs that did not move are skipped. This needs
+   the file on disk to still be the one mapped and the prefix to be in saved
+   form already. Unlike a full save it is not atomic. Returns 0 when saved,
+   -1 when a full save has to be done instead, or an errno. */
+int editorSaveInPlace(const char *path, struct savebuf *sb)
+{
+  struct stat st;
+  if (edt.map == NULL || edt.numrows == 0 || stat(path, &st) == -1 ||
+      st.st_dev != edt.mapstat.st_dev || st.st_ino != edt.mapstat.st_ino ||
+      st.st_size != edt.mapstat.st_size)
+    return -1;
+  struct timespec mtime = editorFileMtime(&st);
+  struct timespec mapped = editorFileMtime(&edt.mapstat);
+  if (mtime.tv_sec != mapped.tv_sec || mtime.tv_nsec != mapped.tv_nsec)
+    return -1;
+
+  long first = edt.edit_from < edt.numrows ? edt.edit_from : edt.numrows;
+  if (first > edt.rawline)
+    first = edt.rawline;
+
+  int npieces = 0;
+  int cap = 16;
+  struct savepiece *pcs = malloc(sizeof(struct savepiece) * cap);
+  size_t len = edt.lineoff[first];
+  int base = 0;
+  struct rowspan *sp = first < edt.numrows ? editorSpanFind(first, &base) : NULL;
+  for (int from = first - base; sp; sp = editorSpanNext(sp), from = 0)
+  {
+    if (npieces == cap)
+    {
+      cap *= 2;
+      pcs = realloc(pcs, sizeof(struct savepiece) * cap);
+    }
+    struct savepiece *pc = &pcs[npieces++];
+    pc->sp = sp;
+    pc->from = from;
+    pc->count = sp->count - from;
+    pc->dst = len;
+    pc->src = 0;
+    pc->len = 0;
+    if (sp->line >= 0)
+    {
+      long line = sp->line + from;
+      if (line + pc->count > edt.rawline)
+      {
+        free(pcs);
+        return -1;
+      }
+      pc->src = edt.lineoff[line];
+      pc->len = edt.lineoff[line + pc->count] - pc->src;
+    }
+    else
+    {
+      for (int k = from; k < sp->count; k++)
+        pc->len += sp->rows[k]->size + 1;
+    }
+    len += pc->len;
+  }
+
+  int fd = open(path, O_RDWR);
+  if (fd == -1)
+  {
+    free(pcs);
+    return -1;
+  }
+
+  /* claim the space up front so running out of it cannot strand a half
+     moved tail */
+  int err = 0;
+  if (len > edt.maplen && (err = editorFileReserve(fd, edt.maplen, len - edt.maplen)) != 0)
+    ftruncate(fd, edt.maplen);
+  char *map = MAP_FAILED;
+  if (err == 0 && (map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    err = errno;
+
+  /* runs of pieces that move towards the end, and rows from memory whose
+     bytes may land on them, are written last first */
+  char *buf = malloc(TERM_SAVE_CHUNK);
+  sb->fd = fd;
+  for (int i = 0; i < npieces && err == 0;)
+  {
+    int j = i;
+    while (j < npieces && (pcs[j].sp->line < 0 || pcs[j].dst > pcs[j].src))
+      j++;
+    if (j > i)
+    {
+      for (int k = j; k-- > i && err == 0;)
+        err = savePiece(sb, &pcs[k], buf);
+    }
+    else
+      err = savePiece(sb, &pcs[j++], buf);
+    i = j;
+  }
+  free(buf);
+
+  if (err == 0 && len < edt.maplen && ftruncate(fd, len) == -1)
+    err = errno;
+  if (err == 0 && TERM_SAVE_FSYNC && fsync(fd) == -1)
+    err = errno;
+
+  if (err == 0)
+  {
+    size_t *lineoff = malloc(sizeof(size_t) * (edt.numrows + 1));
+    memcpy(lineoff, edt.lineoff, sizeof(size_t) * first);
+    long at = first;
+    for (int i = 0; i < npieces; i++)
+    {
+      struct savepiece *pc = &pcs[i];
+      size_t off = pc->dst;
+      for (int k = pc->from; k < pc->from + pc->count; k++)
+      {
+        if (pc->sp->line >= 0)
+          lineoff[at++] = edt.lineoff[pc->sp->line + k] - pc->src + pc->dst;
+        else
+        {
+          lineoff[at++] = off;
+          off += pc->sp->rows[k]->size + 1;
+        }
+      }
+    }
+    lineoff[at] = len;
+    editorRebase(map, len, lineoff);
+    fstat(fd, &edt.mapstat);
+  }
+  else if (map != MAP_FAILED)
+    munmap(map, len);
+
+  close(fd);
+  free(pcs);
+  return err;
+}
+
+/* Save through a temp file in the same directory that is renamed over the
+   original, so a crash mid-save leaves the old file intact. */
+int editorSaveFull(char *path, struct savebuf *sb)
+{
+  char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  size_t tmplen = strlen(path) + 16;
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%.*s.%s.XXXXXX", dirlen, path, slash ? slash + 1 : path);
+
+  int err = 0;
+  sb->fd = mkstemp(tmp);
+  if (sb->fd == -1)
+  {
+    free(tmp);
+    return errno;
+  }
+
+  struct stat st;
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(sb->fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : (0644 & ~mask));
+
+  if (!editorWriteRows(sb))
+    err = sb->err;
+  else if (TERM_SAVE_FSYNC && fsync(sb->fd) == -1)
+    err = errno;
+  if (err == 0 && rename(tmp, path) == -1)
+    err = errno;
+
+  if (err)
+    unlink(tmp);
+  else if (edt.map)
+  {
+    char *map = sb->total ? mmap(NULL, sb->total, PROT_READ, MAP_PRIVATE, sb->fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED)
+    {
+      editorRebase(map, sb->total, NULL);
+      fstat(sb->fd, &edt.mapstat);
+    }
+  }
+  if (close(sb->fd) == -1 && err == 0)
+    err = errno;
+
+  if (err == 0 && TERM_SAVE_FSYNC)
+  {
+    if (dirlen)
+      path[dirlen] = '\0';
+    int dfd = open(dirlen ? path : ".", O_RDONLY);
+    if (dfd != -1)
+    {
+      fsync(dfd);
+      close(dfd);
+    }
+  }
+  free(tmp);
+  return err;
+}
+
+/* Saves of a mapped file only rewrite what follows the first edit when they
+   can; everything else, and anything they cannot handle, is saved in full. */
+void editorSave()
+{
+  if (edt.filename == NULL)
+  {
+
+    edt.filename = editorPrompt("Save as: %s", NULL);
+    if (edt.filename == NULL)
+    {
+      editorSetStatusMessage("Save Aborted");
+      return;
+    }
+
+    editorSelectSyntaxHighlight();
+  }
+
+  /* the index workers read the map, which a save may replace */
+  int searching = edt.search.nsegs != 0;
+  editorIndexStop();
+
+  long start = editorNowMs();
+  char *path = realpath(edt.filename, NULL);
+  if (path == NULL)
+    path = strdup(edt.filename);
+
+  struct savebuf *sb = malloc(sizeof(struct savebuf));
+  sb->off = 0;
+  sb->n = 0;
+  sb->total = 0;
+  sb->err = 0;
+  int err = TERM_SAVE_INPLACE ? editorSaveInPlace(path, sb) : -1;
+  int inplace = err != -1;
+  if (err == -1)
+    err = editorSaveFull(path, sb);
+
+  if (err)
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  else
+  {
+    long ms = editorNowMs() - start;
+    edt.unch = 0;
+    edt.edit_from = edt.numrows;
+    journalReset();
+    editorSetStatusMessage("%zu bytes have been written to disk (%ld ms, %.1f MB/s%s)",
+                           sb->total, ms, ms ? sb->total / 1048.576 / ms : 0.0,
+                           inplace ? ", in place" : "");
+  }
+  free(sb);
+  free(path);
+  if (searching)
+    editorIndexStart();
+}
+
+// regex
+
+struct reparse
+{
+  const char *s;
+  int pos;
+  int icase;
+  struct renode *n;
+  int count;
+  int cap;
+  const char *err;
+};
+
+int reNode(struct reparse *rp, int type, int a, int b)
+{
+  if (rp->count == rp->cap)
+  {
+    rp->cap = rp->cap ? rp->cap * 2 : 32;
+    rp->n = realloc(rp->n, sizeof(struct renode) * rp->cap);
+  }
+  struct renode *n = &rp->n[rp->count];
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  memset(n->set, 0, sizeof(n->set));
+  return rp->count++;
+}
+
+int reSetHas(const unsigned char *set, int c)
+{
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+void reSetAdd(struct reparse *rp, unsigned char *set, int c)
+{
+  set[c >> 3] |= 1 << (c & 7);
+  if (rp->icase)
+  {
+    set[tolower(c) >> 3] |= 1 << (tolower(c) & 7);
+    set[toupper(c) >> 3] |= 1 << (toupper(c) & 7);
+  }
+}
+
+/* Adds the class for \d, \w, \s or their negations; 0 if c names none. */
+int reSetClass(unsigned char *set, int c)
+{
+  unsigned char cls[32] = {0};
+  for (int k = 0; k < 256; k++)
+  {
+    int in = tolower(c) == 'd' ? isdigit(k) : tolower(c) == 'w' ? patWordByte(k) : tolower(c) == 's' ? isspace(k) : -1;
+    if (in < 0)
+      return 0;
+    if (in && k != '\n')
+      cls[k >> 3] |= 1 << (k & 7);
+  }
+  for (int k = 0; k < 32; k++)
+    set[k] |= isupper(c) ? ~cls[k] : cls[k];
+  set['\n' >> 3] &= ~(1 << ('\n' & 7));
+  return 1;
+}
+
+int reEscape(int c)
+{
+  return c == 't' ? '\t' : c;
+}
+
+void reClass(struct reparse *rp, unsigned char *set)
+{
+  int neg = rp->s[rp->pos] == '^';
+  if (neg)
+    rp->pos++;
+  for (int first = 1; first || rp->s[rp->pos] != ']'; first = 0)
+  {
+    int c = (unsigned char)rp->s[rp->pos++];
+    if (c == '\0')
+    {
+      rp->err = "missing ]";
+      return;
+    }
+    if (c == '\\')
+    {
+      c = (unsigned char)rp->s[rp->pos++];
+      if (c == '\0')
+      {
+        rp->err = "trailing \\";
+        return;
+      }
+      if (reSetClass(set, c))
+        continue;
+      c = reEscape(c);
+    }
+    int hi = c;
+    if (rp->s[rp->pos] == '-' && rp->s[rp->pos + 1] != ']' && rp->s[rp->pos + 1] != '\0')
+    {
+      hi = (unsigned char)rp->s[rp->pos + 1];
+      rp->pos += 2;
+      if (hi == '\\' && rp->s[rp->pos] != '\0')
+        hi = reEscape((unsigned char)rp->s[rp->pos++]);
+      if (hi < c)
+      {
+        rp->err = "bad range";
+        return;
+      }
+    }
+    for (int k = c; k <= hi; k++)
+      reSetAdd(rp, set, k);
+  }
+  rp->pos++;
+  if (neg)
+    for (int k = 0; k < 32; k++)
+      set[k] = ~set[k];
+  set['\n' >> 3] &= ~(1 << ('\n' & 7));
+}
+
+int reAlt(struct reparse *rp);
+
+int reAtom(struct reparse *rp)
+{
+  int c = (unsigned char)rp->s[rp->pos++];
+  if (c == '(')
+  {
+    int a = reAlt(rp);
+    if (a < 0)
+      return -1;
+    if (rp->s[rp->pos] != ')')
+    {
+      rp->err = "missing )";
+      return -1;
+    }
+    rp->pos++;
+    return a;
+  }
+  if (c == '^' || c == '$')
+    return reNode(rp, c == '^' ? RE_BOL : RE_EOL, -1, -1);
+  if (c == '*' || c == '+' || c == '?')
+  {
+    rp->err = "nothing to repeat";
+    return -1;
+  }
+
+  int n = reNode(rp, RE_SET, -1, -1);
+  unsigned char *set = rp->n[n].set;
+  if (c == '.')
+  {
+    memset(set, 0xff, sizeof(rp->n[n].set));
+    set['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  else if (c == '[')
+    reClass(rp, set);
+  else if (c == '\\')
+  {
+    c = (unsigned char)rp->s[rp->pos++];
+    if (c == '\0')
+      rp->err = "trailing \\";
+    else if (!reSetClass(set, c))
+      reSetAdd(rp, set, reEscape(c));
+  }
+  else
+    reSetAdd(rp, set, c);
+  return rp->err ? -1 : n;
+}
+
+int reRepeat(struct reparse *rp)
+{
+  int a = reAtom(rp);
+  while (a >= 0)
+  {
+    char c = rp->s[rp->pos];
+    int type = c == '*' ? RE_STAR : c == '+' ? RE_PLUS : c == '?' ? RE_QUEST : -1;
+    if (type < 0)
+      break;
+    rp->pos++;
+    a = reNode(rp, type, a, -1);
+  }
+  return a;
+}
+
+int reCat(struct reparse *rp)
+{
+  int a = -1;
+  while (rp->s[rp->pos] != '\0' && rp->s[rp->pos] != '|' && rp->s[rp->pos] != ')')
+  {
+    int b = reRepeat(rp);
+    if (b < 0)
+      return -1;
+    a = a < 0 ? b : reNode(rp, RE_CAT, a, b);
+  }
+  return a < 0 ? reNode(rp, RE_EMPTY, -1, -1) : a;
+}
+
+int reAlt(struct reparse *rp)
+{
+  int a = reCat(rp);
+  while (a >= 0 && rp->s[rp->pos] == '|')
+  {
+    rp->pos++;
+    int b = reCat(rp);
+    if (b < 0)
+      return -1;
+    a = reNode(rp, RE_ALT, a, b);
+  }
+  return a;
+}
+
+int nfaState(struct nfa *f, int type, int out, int out1)
+{
+  if (f->n == f->cap)
+  {
+    f->cap = f->cap ? f->cap * 2 : 32;
+    f->s = realloc(f->s, sizeof(struct nstate) * f->cap);
+  }
+  f->s[f->n].type = type;
+  f->s[f->n].out = out;
+  f->s[f->n].out1 = out1;
+  return f->n++;
+}
+
+/* Thompson's construction: returns the fragment's first state and stores
+   its last one, an NFA_EPS whose out is still to be patched, in end. The
+   reversed NFA matches the reversed language: concatenations swap and so
+   do ^ and $. */
+int nfaBuild(struct nfa *f, struct renode *n, int i, int reverse, int *end)
+{
+  struct renode *r = &n[i];
+  int s, e, a, ae, b, be;
+  switch (r->type)
+  {
+  case RE_SET:
+    e = nfaState(f, NFA_EPS, -1, -1);
+    s = nfaState(f, NFA_SET, e, -1);
+    memcpy(f->s[s].set, r->set, sizeof(r->set));
+    break;
+  case RE_BOL:
+  case RE_EOL:
+    e = nfaState(f, NFA_EPS, -1, -1);
+    s = nfaState(f, (r->type == RE_BOL) != reverse ? NFA_BOL : NFA_EOL, e, -1);
+    break;
+  case RE_CAT:
+    s = nfaBuild(f, n, reverse ? r->b : r->a, reverse, &ae);
+    b = nfaBuild(f, n, reverse ? r->a : r->b, reverse, &e);
+    f->s[ae].out = b;
+    break;
+  case RE_ALT:
+    a = nfaBuild(f, n, r->a, reverse, &ae);
+    b = nfaBuild(f, n, r->b, reverse, &be);
+    e = nfaState(f, NFA_EPS, -1, -1);
+    f->s[ae].out = e;
+    f->s[be].out = e;
+    s = nfaState(f, NFA_SPLIT, a, b);
+    break;
+  case RE_STAR:
+  case RE_QUEST:
+    a = nfaBuild(f, n, r->a, reverse, &ae);
+    e = nfaState(f, NFA_EPS, -1, -1);
+    s = nfaState(f, NFA_SPLIT, a, e);
+    f->s[ae].out = r->type == RE_STAR ? s : e;
+    break;
+  case RE_PLUS:
+    s = nfaBuild(f, n, r->a, reverse, &ae);
+    e = nfaState(f, NFA_EPS, -1, -1);
+    b = nfaState(f, NFA_SPLIT, s, e);
+    f->s[ae].out = b;
+    break;
+  default:
+    s = e = nfaState(f, NFA_EPS, -1, -1);
+  }
+  *end = e;
+  return s;
+}
+
+void nfaCompile(struct nfa *f, struct renode *n, int root, int reverse)
+{
+  int end;
+  f->start = nfaBuild(f, n, root, reverse, &end);
+  int match = nfaState(f, NFA_MATCH, -1, -1);
+  f->s[end].out = match;
+}
+
+void dfaInit(struct dfa *d, struct nfa *f, int unanchored)
+{
+  memset(d, 0, sizeof(struct dfa));
+  d->nfa = f;
+  d->unanchored = unanchored;
+  d->start[0] = d->start[1] = -1;
+  d->stack = malloc(sizeof(int) * (2 * f->n + 1));
+  d->list = malloc(sizeof(int) * f->n);
+  d->mark = calloc(f->n, sizeof(unsigned int));
+}
+
+void dfaFlush(struct dfa *d)
+{
+  for (int k = 0; k < d->n; k++)
+    free(d->sets[k]);
+  d->n = 0;
+  d->start[0] = d->start[1] = -1;
+  if (d->hash)
+    memset(d->hash, 0xff, sizeof(int) * d->hcap);
+}
+
+void dfaFree(struct dfa *d)
+{
+  dfaFlush(d);
+  free(d->trans);
+  free(d->sets);
+  free(d->setlen);
+  free(d->accept);
+  free(d->hash);
+  free(d->stack);
+  free(d->list);
+  free(d->mark);
+}
+
+/* Add the epsilon closure of NFA state i to d->list. Assertions pass only
+   when bol or eol says so; an unsatisfied $ stays in the set to be checked
+   at the end of the line. */
+void dfaClosure(struct dfa *d, int i, int bol, int eol, int *count)
+{
+  int sp = 0;
+  d->stack[sp++] = i;
+  while (sp)
+  {
+    int k = d->stack[--sp];
+    if (d->mark[k] == d->gen)
+      continue;
+    d->mark[k] = d->gen;
+    struct nstate *st = &d->nfa->s[k];
+    if (st->type == NFA_EPS || (st->type == NFA_BOL && bol) || (st->type == NFA_EOL && eol))
+      d->stack[sp++] = st->out;
+    else if (st->type == NFA_SPLIT)
+    {
+      d->stack[sp++] = st->out1;
+      d->stack[sp++] = st->out;
+    }
+    else if (st->type != NFA_BOL)
+      d->list[(*count)++] = k;
+  }
+}
+
+unsigned int dfaHash(const int *list, int count)
+{
+  unsigned int h = 2166136261u;
+  for (int k = 0; k < count; k++)
+    h = (h ^ list[k]) * 16777619u;
+  return h;
+}
+
+/* The DFA state for the NFA states in list, made if new; -1 when the cache
+   is full. */
+int dfaIntern(struct dfa *d, int *list, int count)
+{
+  for (int i = 1; i < count; i++)
+    for (int j = i; j > 0 && list[j - 1] > list[j]; j--)
+    {
+      int t = list[j];
+      list[j] = list[j - 1];
+      list[j - 1] = t;
+    }
+
+  unsigned int h = dfaHash(list, count);
+  if (d->hcap)
+    for (unsigned int k = h & (d->hcap - 1); d->hash[k] >= 0; k = (k + 1) & (d->hcap - 1))
+    {
+      int s = d->hash[k];
+      if (d->setlen[s] == count && memcmp(d->sets[s], list, sizeof(int) * count) == 0)
+        return s;
+    }
+  if (d->n == TERM_DFA_STATES)
+    return -1;
+
+  if (d->n == d->cap)
+  {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->trans = realloc(d->trans, sizeof(int) * DFA_SYMBOLS * d->cap);
+    d->sets = realloc(d->sets, sizeof(int *) * d->cap);
+    d->setlen = realloc(d->setlen, sizeof(int) * d->cap);
+    d->accept = realloc(d->accept, d->cap);
+    d->hcap = d->cap * 2;
+    d->hash = realloc(d->hash, sizeof(int) * d->hcap);
+    memset(d->hash, 0xff, sizeof(int) * d->hcap);
+    for (int s = 0; s < d->n; s++)
+    {
+      unsigned int k = dfaHash(d->sets[s], d->setlen[s]) & (d->hcap - 1);
+      while (d->hash[k] >= 0)
+        k = (k + 1) & (d->hcap - 1);
+      d->hash[k] = s;
+    }
+  }
+
+  int s = d->n++;
+  memset(&d->trans[s * DFA_SYMBOLS], 0xff, sizeof(int) * DFA_SYMBOLS);
+  d->sets[s] = malloc(sizeof(int) * (count ? count : 1));
+  memcpy(d->sets[s], list, sizeof(int) * count);
+  d->setlen[s] = count;
+  d->accept[s] = 0;
+  for (int k = 0; k < count; k++)
+    if (d->nfa->s[list[k]].type == NFA_MATCH)
+      d->accept[s] = 1;
+
+  unsigned int k = h & (d->hcap - 1);
+  while (d->hash[k] >= 0)
+    k = (k + 1) & (d->hcap - 1);
+  d->hash[k] = s;
+  return s;
+}
+
+int dfaStart(struct dfa *d, int bol)
+{
+  if (d->start[bol] >= 0)
+    return d->start[bol];
+  int count = 0;
+  d->gen++;
+  dfaClosure(d, d->nfa->start, bol, 0, &count);
+  int s = dfaIntern(d, d->list, count);
+  if (s < 0)
+  {
+    dfaFlush(d);
+    s = dfaIntern(d, d->list, count);
+  }
+  return d->start[bol] = s;
+}
+
+/* The state after s on byte c, or at the end of the line for DFA_EOL and
+   DFA_EOL_BOL, the latter for an empty line. An unanchored DFA may start a
+   new match after every byte. */
+int dfaStep(struct dfa *d, int s, int c)
+{
+  int t = d->trans[s * DFA_SYMBOLS + c];
+  if (t >= 0)
+    return t;
+
+  int count = 0;
+  d->gen++;
+  for (int k = 0; k < d->setlen[s]; k++)
+  {
+    struct nstate *st = &d->nfa->s[d->sets[s][k]];
+    if (c >= DFA_EOL ? st->type == NFA_EOL : st->type == NFA_SET && reSetHas(st->set, c))
+      dfaClosure(d, st->out, c == DFA_EOL_BOL, c >= DFA_EOL, &count);
+  }
+  if (d->unanchored && c < DFA_EOL)
+    dfaClosure(d, d->nfa->start, 0, 0, &count);
+
+  t = dfaIntern(d, d->list, count);
+  if (t >= 0)
+    return d->trans[s * DFA_SYMBOLS + c] = t;
+  dfaFlush(d);
+  return dfaIntern(d, d->list, count);
+}
+
+int reLineStart(const char *buf, size_t i)
+{
+  return i == 0 || buf[i - 1] == '\n';
+}
+
+/* Lines may end in \r\n, whose \r is not part of the line either. */
+int reLineEnd(const char *buf, size_t len, size_t i)
+{
+  if (i == len || buf[i] == '\n')
+    return 1;
+  if (buf[i] != '\r')
+    return 0;
+  while (i < len && buf[i] == '\r')
+    i++;
+  return i == len || buf[i] == '\n';
+}
+
+/* Length of the longest match starting at buf[at], or -1. */
+long reLongest(struct dfa *d, const char *buf, size_t len, size_t at)
+{
+  int s = dfaStart(d, reLineStart(buf, at));
+  long best = d->accept[s] ? 0 : -1;
+  size_t i = at;
+  for (; !reLineEnd(buf, len, i); i++)
+  {
+    unsigned char c = buf[i];
+    int t = d->trans[s * DFA_SYMBOLS + c];
+    s = t >= 0 ? t : dfaStep(d, s, c);
+    if (d->setlen[s] == 0)
+      return best;
+    if (d->accept[s])
+      best = i + 1 - at;
+  }
+  s = dfaStep(d, s, reLineStart(buf, i) ? DFA_EOL_BOL : DFA_EOL);
+  return d->accept[s] ? (long)(i - at) : best;
+}
+
+struct reliteral
+{
+  char run[TERM_RE_LITERAL + 1];
+  int len;
+  int lead;
+  char best[TERM_RE_LITERAL + 1];
+  int bestlen;
+  int prefix;
+};
+
+/* The char a node matches if it matches a single one, ignoring case when
+   icase; -1 otherwise. */
+int reSetChar(struct renode *r, int icase)
+{
+  if (r->type != RE_SET)
+    return -1;
+  int c = -1, count = 0;
+  for (int k = 0; k < 256; k++)
+    if (reSetHas(r->set, k))
+    {
+      count++;
+      if (c < 0)
+        c = k;
+    }
+  if (c <= 0 || !(count == 1 || (icase && count == 2 && isupper(c) && reSetHas(r->set, tolower(c)))))
+    return -1;
+  return c;
+}
+
+/* Walks the top-level concatenation for runs of single chars. */
+void reLiteral(struct renode *n, int i, int icase, struct reliteral *lit)
+{
+  struct renode *r = &n[i];
+  if (r->type == RE_CAT)
+  {
+    reLiteral(n, r->a, icase, lit);
+    reLiteral(n, r->b, icase, lit);
+    return;
+  }
+  if (r->type == RE_BOL && lit->lead && lit->len == 0)
+    return;
+
+  int c = reSetChar(r, icase);
+  if (c < 0 || lit->len == TERM_RE_LITERAL)
+  {
+    lit->len = 0;
+    lit->lead = 0;
+    if (c < 0)
+      return;
+  }
+  lit->run[lit->len++] = c;
+  if (lit->len > lit->bestlen)
+  {
+    memcpy(lit->best, lit->run, lit->len);
+    lit->bestlen = lit->len;
+    lit->prefix = lit->lead;
+  }
+}
+
+void reMatchInit(struct rematch *rm, struct regex *re)
+{
+  dfaInit(&rm->scan, &re->fwd, 1);
+  dfaInit(&rm->back, &re->rev, 1);
+  dfaInit(&rm->anchor, &re->fwd, 0);
+  rm->lo = rm->end = NULL;
+  rm->starts = NULL;
+  rm->n = rm->cap = rm->next = 0;
+  rm->dropped = 0;
+}
+
+void reMatchFree(struct rematch *rm)
+{
+  dfaFree(&rm->scan);
+  dfaFree(&rm->back);
+  dfaFree(&rm->anchor);
+  free(rm->starts);
+}
+
+void reFree(struct regex *re)
+{
+  if (re == NULL)
+    return;
+  reMatchFree(&re->main);
+  free(re->fwd.s);
+  free(re->rev.s);
+  free(re->lit.s);
+  free(re);
+}
+
+/* Forget the match starts of the main thread's line: the text may have
+   changed under them. */
+void patForget(struct pattern *p)
+{
+  if (p->re)
+    p->re->main.end = NULL;
+}
+
+struct regex *reCompile(const char *s, int icase, const char **err)
+{
+  struct reparse rp = {.s = s, .icase = icase};
+  int root = reAlt(&rp);
+  if (rp.err == NULL && s[rp.pos] == ')')
+    rp.err = "unmatched )";
+  if (rp.err)
+  {
+    free(rp.n);
+    *err = rp.err;
+    return NULL;
+  }
+
+  struct regex *re = calloc(1, sizeof(struct regex));
+  nfaCompile(&re->fwd, rp.n, root, 0);
+  nfaCompile(&re->rev, rp.n, root, 1);
+  struct reliteral lit = {.lead = 1};
+  reLiteral(rp.n, root, icase, &lit);
+  lit.best[lit.bestlen] = '\0';
+  patCompile(&re->lit, lit.best, icase, 0, 0);
+  re->prefix = lit.prefix;
+  reMatchInit(&re->main, re);
+  free(rp.n);
+  return re;
+}
+
+void reStartPush(struct rematch *rm, const char *p)
+{
+  if (rm->n > 0 && rm->starts[(rm->n - 1) % rm->cap] == p)
+    return;
+  if (rm->n == rm->cap && rm->cap < TERM_RE_STARTS)
+  {
+    rm->cap = rm->cap ? rm->cap * 2 : 64;
+    rm->starts = realloc(rm->starts, sizeof(char *) * rm->cap);
+  }
+  if (rm->n >= rm->cap)
+    rm->dropped = 1;
+  rm->starts[rm->n++ % rm->cap] = p;
+}
+
+void reStartsReverse(const char **a, long i, long j)
+{
+  for (j--; i < j; i++, j--)
+  {
+    const char *t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+  }
+}
+
+/* Run the reversed DFA back from the end e of the line to from, noting
+   every position a match starts at. */
+void reLineStarts(struct rematch *rm, const char *buf, size_t len, size_t from, size_t e)
+{
+  struct dfa *b = &rm->back;
+  rm->lo = &buf[from];
+  rm->end = &buf[e];
+  rm->n = 0;
+  rm->dropped = 0;
+  int s = dfaStart(b, 1);
+  if (b->accept[s])
+    reStartPush(rm, &buf[e]);
+  for (size_t i = e; i > from; i--)
+  {
+    unsigned char c = buf[i - 1];
+    int t = b->trans[s * DFA_SYMBOLS + c];
+    s = t >= 0 ? t : dfaStep(b, s, c);
+    if (b->accept[s])
+      reStartPush(rm, &buf[i - 1]);
+  }
+  if (reLineStart(buf, from) && b->accept[dfaStep(b, s, reLineEnd(buf, len, from) ? DFA_EOL_BOL : DFA_EOL)])
+    reStartPush(rm, &buf[from]);
+
+  /* put the starts kept, pushed right to left into a ring, in order */
+  if (rm->n > rm->cap)
+  {
+    reStartsReverse(rm->starts, 0, rm->n % rm->cap);
+    reStartsReverse(rm->starts, rm->n % rm->cap, rm->cap);
+    rm->n = rm->cap;
+  }
+  else
+    reStartsReverse(rm->starts, 0, rm->n);
+  rm->next = 0;
+}
+
+/* The first noted match start at or after at, or NULL. Searches mostly go
+   on from just past the last match, so the look starts there. */
+const char *reStartAfter(struct rematch *rm, const char *at)
+{
+  long lo = rm->next;
+  if (lo > 0 && rm->starts[lo - 1] >= at)
+    lo = 0;
+  long step = 1;
+  while (lo + step <= rm->n && rm->starts[lo + step - 1] < at)
+  {
+    lo += step;
+    step *= 2;
+  }
+  long hi = lo + step - 1 < rm->n ? lo + step - 1 : rm->n;
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (rm->starts[mid] < at)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  rm->next = lo;
+  return lo < rm->n ? rm->starts[lo] : NULL;
+}
+
+/* Leftmost-longest match in the line buf[from, e), where e is the end of
+   the line's text. The scan DFA tells whether there is a match at all, the
+   reversed DFA run back from the line end finds where every match starts
+   and the anchored DFA how far the first one reaches. The starts are kept,
+   so going through all the matches of a line scans it back once. */
+long reFindLine(struct rematch *rm, const char *buf, size_t len, size_t from, size_t e, int *mlen)
+{
+  const char *at = &buf[from];
+  if (rm->end != &buf[e] || at < rm->lo)
+  {
+    struct dfa *d = &rm->scan;
+    int s = dfaStart(d, reLineStart(buf, from));
+    for (size_t i = from; i < e && !d->accept[s]; i++)
+    {
+      unsigned char c = buf[i];
+      int t = d->trans[s * DFA_SYMBOLS + c];
+      s = t >= 0 ? t : dfaStep(d, s, c);
+    }
+    if (!d->accept[s] && !d->accept[dfaStep(d, s, reLineStart(buf, e) ? DFA_EOL_BOL : DFA_EOL)])
+      return -1;
+    reLineStarts(rm, buf, len, from, e);
+  }
+
+  const char *p = reStartAfter(rm, at);
+  if (p == NULL && rm->dropped)
+  {
+    reLineStarts(rm, buf, len, from, e);
+    p = reStartAfter(rm, at);
+  }
+  if (p == NULL)
+    return -1;
+  long start = p - buf;
+  *mlen = reLongest(&rm->anchor, buf, len, start);
+  return start;
+}
+
+/* Leftmost-longest match in buf[from, len), which holds whole lines, and
+   never across a line end. Only lines holding the pattern's literal are
+   looked at; if the literal is a prefix, each of its occurrences is tried
+   as a match start with the anchored DFA alone. */
+long reFind(struct regex *re, struct rematch *rm, const char *buf, size_t len, size_t from, int *mlen)
+{
+  if (from > len)
+    return -1;
+  if (from > 0 && buf[from - 1] == '\r' && reLineEnd(buf, len, from - 1))
+  {
+    const char *nl = memchr(&buf[from], '\n', len - from);
+    if (nl == NULL)
+      return -1;
+    from = nl + 1 - buf;
+  }
+  if (from > len || (from > 0 && from == len && buf[from - 1] == '\n'))
+    return -1;
+
+  if (re->lit.len && re->prefix)
+  {
+    for (long o = patFindLiteral(&re->lit, buf, len, from); o >= 0; o = patFindLiteral(&re->lit, buf, len, o + 1))
+    {
+      long l = reLongest(&rm->anchor, buf, len, o);
+      if (l >= 0)
+      {
+        *mlen = l;
+        return o;
+      }
+    }
+    return -1;
+  }
+
+  size_t ls = from;
+  for (;;)
+  {
+    if (re->lit.len)
+    {
+      long o = patFindLiteral(&re->lit, buf, len, ls);
+      if (o < 0)
+        return -1;
+      size_t at = o;
+      while (at > ls && buf[at - 1] != '\n')
+        at--;
+      ls = at;
+    }
+    /* the line end is known if the line was scanned before */
+    const char *nl;
+    size_t e;
+    if (rm->end && &buf[ls] >= rm->lo && &buf[ls] <= rm->end && rm->end <= &buf[len])
+    {
+      e = rm->end - buf;
+      size_t j = e;
+      while (j < len && buf[j] == '\r')
+        j++;
+      nl = j < len ? &buf[j] : NULL;
+    }
+    else
+    {
+      nl = memchr(&buf[ls], '\n', len - ls);
+      e = nl ? (size_t)(nl - buf) : len;
+      while (e > ls && buf[e - 1] == '\r')
+        e--;
+    }
+    long m = reFindLine(rm, buf, len, ls, e, mlen);
+    if (m >= 0)
+      return m;
+    if (nl == NULL || nl + 1 == buf + len)
+      return -1;
+    ls = nl + 1 - buf;
+  }
+}
+
+// search func
+
+int patWordByte(int c)
+{
+  return isalnum(c) || c == '_';
+}
+
+/* Returns -1, with p->err set, if s is not a valid regex. */
+int patCompile(struct pattern *p, const char *s, int icase, int word, int regex)
+{
+  p->len = strlen(s);
+  p->s = realloc(p->s, p->len + 1);
+  p->icase = icase;
+  p->word = word;
+  for (int c = 0; c < 256; c++)
+  {
+    p->fold[c] = icase ? tolower(c) : c;
+    p->shift[c] = p->len;
+  }
+  for (int i = 0; i < p->len; i++)
+    p->s[i] = p->fold[(unsigned char)s[i]];
+  for (int i = 0; i + 1 < p->len; i++)
+    p->shift[p->s[i]] = p->len - 1 - i;
+
+  reFree(p->re);
+  p->re = NULL;
+  p->err = NULL;
+  if (regex && p->len)
+    p->re = reCompile(s, icase, &p->err);
+  return p->err ? -1 : 0;
+}
+
+int patAt(struct pattern *p, const char *buf, size_t len, size_t at)
+{
+  const unsigned char *t = (const unsigned char *)&buf[at];
+  if (p->icase)
+  {
+    for (int i = 0; i < p->len; i++)
+      if (p->fold[t[i]] != p->s[i])
+        return 0;
+  }
+  else if (memcmp(t, p->s, p->len) != 0)
+    return 0;
+
+  if (p->word)
+  {
+    if (at > 0 && patWordByte((unsigned char)buf[at - 1]))
+      return 0;
+    if (at + p->len < len && patWordByte((unsigned char)buf[at + p->len]))
+      return 0;
+  }
+  return 1;
+}
+
+/* Offset of the first match in buf[from, len), or -1. With SSE2, blocks of
+   16 candidate positions are filtered on the pattern's first and last byte
+   at once; Horspool handles the rest. Since buf may hold many lines, matches
+   never contain a newline: queries are typed on one line. */
+long patFindLiteral(struct pattern *p, const char *buf, size_t len, size_t from)
+{
+  size_t m = p->len;
+  if (m == 0 || from + m > len)
+    return -1;
+  size_t i = from;
+
+#ifdef __SSE2__
+  unsigned char first = p->s[0], last = p->s[m - 1];
+  const __m128i f1 = _mm_set1_epi8(first);
+  const __m128i f2 = _mm_set1_epi8(p->icase ? toupper(first) : first);
+  const __m128i l1 = _mm_set1_epi8(last);
+  const __m128i l2 = _mm_set1_epi8(p->icase ? toupper(last) : last);
+  for (; i + m - 1 + 16 <= len; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)&buf[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&buf[i + m - 1]);
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f1), _mm_cmpeq_epi8(a, f2)),
+                      _mm_or_si128(_mm_cmpeq_epi8(b, l1), _mm_cmpeq_epi8(b, l2))));
+    while (mask)
+    {
+      size_t at = i + __builtin_ctz(mask);
+      if (patAt(p, buf, len, at))
+        return at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i + m <= len)
+  {
+    unsigned char c = p->fold[(unsigned char)buf[i + m - 1]];
+    if (c == p->s[m - 1] && patAt(p, buf, len, i))
+      return i;
+    i += p->shift[c];
+  }
+  return -1;
+}
+
+/* First match in buf[from, len) and its length in mlen. rm holds the
+   calling thread's DFAs, NULL for the main thread. */
+long patFind(struct pattern *p, struct rematch *rm, const char *buf, size_t len, size_t from, int *mlen)
+{
+  if (p->re == NULL)
+  {
+    *mlen = p->len;
+    return patFindLiteral(p, buf, len, from);
+  }
+  for (;;)
+  {
+    long m = reFind(p->re, rm ? rm : &p->re->main, buf, len, from, mlen);
+    if (m < 0 || !p->word ||
+        ((m == 0 || !patWordByte((unsigned char)buf[m - 1])) &&
+         (m + *mlen == (long)len || !patWordByte((unsigned char)buf[m + *mlen]))))
+      return m;
+    from = m + 1;
+  }
+}
+
+/* The chars of row at, taken from the map for rows not loaded yet so that
+   searching never materializes rows. */
+const char *editorRowText(int at, int *len)
+{
+  int base;
+  struct rowspan *sp = editorSpanFind(at, &base);
+  if (sp->line < 0)
+  {
+    *len = sp->rows[at - base]->size;
+    return sp->rows[at - base]->chars;
+  }
+  long line = sp->line + at - base;
+  *len = editorLineLen(line);
+  return &edt.map[edt.lineoff[line]];
+}
+
+/* First match at or after (row, col) and before row end, its length in
+   len. A run of mapped lines is searched as one block of the map. */
+int editorSearchForward(struct pattern *p, int end, int *row, int *col, int *len)
+{
+  int at = *row;
+  size_t from = *col;
+  while (at < end)
+  {
+    int base;
+    struct rowspan *sp = editorSpanFind(at, &base);
+    if (sp->line < 0)
+    {
+      for (; at < base + sp->count && at < end; at++, from = 0)
+      {
+        erow *r = sp->rows[at - base];
+        long m = patFind(p, NULL, r->chars, r->size, from, len);
+        if (m >= 0)
+        {
+          *row = at;
+          *col = m;
+          return 1;
+        }
+      }
+      continue;
+    }
+
+    long first = sp->line + at - base;
+    long stop = sp->line + (end < base + sp->count ? end - base : sp->count);
+    const char *buf = &edt.map[edt.lineoff[first]];
+    if (from > editorLineLen(first))
+    {
+      at++;
+      from = 0;
+      continue;
+    }
+    long m = patFind(p, NULL, buf, edt.lineoff[stop] - edt.lineoff[first], from, len);
+    if (m >= 0)
+    {
+      size_t off = edt.lineoff[first] + m;
+      long lo = first, hi = stop - 1;
+      while (lo < hi)
+      {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (edt.lineoff[mid] <= off)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+      *row = base + (lo - sp->line);
+      *col = off - edt.lineoff[lo];
+      return 1;
+    }
+    at = base + (stop - sp->line);
+    from = 0;
+  }
+  return 0;
+}
+
+/* Last match that starts before col in row, or in any row above it down to
+   row end. */
+int editorSearchBackward(struct pattern *p, int end, int *row, int *col, int *len)
+{
+  int before = *col;
+  for (int at = *row; at >= end; at--, before = INT_MAX)
+  {
+    int size, mlen;
+    const char *text = editorRowText(at, &size);
+    long found = -1;
+    for (long m = patFind(p, NULL, text, size, 0, &mlen); m >= 0 && m < before;
+         m = patFind(p, NULL, text, size, m + 1, &mlen))
+    {
+      found = m;
+      *len = mlen;
+    }
+    if (found >= 0)
+    {
+      *row = at;
+      *col = found;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Find the next match from (row, col) in direction dir, wrapping around the
+   ends of the buffer. */
+int editorSearch(struct pattern *p, int dir, int *row, int *col, int *len)
+{
+  int r = *row, c = *col;
+  if (edt.numrows == 0 || p->len == 0 || p->err)
+    return 0;
+  if (dir > 0)
+  {
+    if (editorSearchForward(p, edt.numrows, &r, &c, len))
+      goto found;
+    r = 0;
+    c = 0;
+    if (editorSearchForward(p, *row + 1, &r, &c, len))
+      goto found;
+  }
+  else
+  {
+    if (editorSearchBackward(p, 0, &r, &c, len))
+      goto found;
+    r = edt.numrows - 1;
+    c = INT_MAX;
+    if (editorSearchBackward(p, *row, &r, &c, len))
+      goto found;
+  }
+  return 0;
+
+found:
+  *row = r;
+  *col = c;
+  return 1;
+}
+
+void searchPush(struct searchseg *sg, int row, int col, int len)
+{
+  if (sg->n == sg->cap)
+  {
+    sg->cap = sg->cap ? sg->cap * 2 : 64;
+    sg->m = realloc(sg->m, sizeof(struct match) * sg->cap);
+  }
+  sg->m[sg->n].row = row;
+  sg->m[sg->n].col = col;
+  sg->m[sg->n].len = len;
+  sg->n++;
+}
+
+/* A pattern like x* matches the empty string between any two chars, so an
+   empty match is only indexed as the first match of its row. */
+void searchPushMatch(struct searchseg *sg, int row, int col, int len)
+{
+  if (len == 0 && sg->n > 0 && sg->m[sg->n - 1].row == row)
+    return;
+  searchPush(sg, row, col, len);
+}
+
+void searchSegment(struct search *sr, struct searchseg *sg, struct rematch *rm)
+{
+  struct pattern *p = &sr->pat;
+  int mlen;
+  if (sg->line < 0)
+  {
+    for (int k = 0; k < sg->count && !__atomic_load_n(&sr->cancel, __ATOMIC_RELAXED); k++)
+    {
+      erow *r = sg->rows[k];
+      for (long m = patFind(p, rm, r->chars, r->size, 0, &mlen); m >= 0;
+           m = patFind(p, rm, r->chars, r->size, m + (mlen ? mlen : 1), &mlen))
+        searchPushMatch(sg, sg->row + k, m, mlen);
+    }
+    return;
+  }
+
+  const char *buf = &edt.map[edt.lineoff[sg->line]];
+  size_t len = edt.lineoff[sg->line + sg->count] - edt.lineoff[sg->line];
+  long line = sg->line;
+  for (long m = patFind(p, rm, buf, len, 0, &mlen); m >= 0 && !__atomic_load_n(&sr->cancel, __ATOMIC_RELAXED);
+       m = patFind(p, rm, buf, len, m + (mlen ? mlen : 1), &mlen))
+  {
+    size_t off = edt.lineoff[sg->line] + m;
+    long hi = sg->line + sg->count - 1;
+    while (line < hi)
+    {
+      long mid = line + (hi - line + 1) / 2;
+      if (edt.lineoff[mid] <= off)
+        line = mid;
+      else
+        hi = mid - 1;
+    }
+    searchPushMatch(sg, sg->row + (line - sg->line), off - edt.lineoff[line], mlen);
+  }
+}
+
+void *searchWorker(void *arg)
+{
+  struct search *sr = arg;
+  struct rematch rm;
+  if (sr->pat.re)
+    reMatchInit(&rm, sr->pat.re);
+  int k;
+  while (!__atomic_load_n(&sr->cancel, __ATOMIC_RELAXED) &&
+         (k = __atomic_fetch_add(&sr->next, 1, __ATOMIC_RELAXED)) < sr->nsegs)
+    searchSegment(sr, &sr->segs[k], sr->pat.re ? &rm : NULL);
+  if (sr->pat.re)
+    reMatchFree(&rm);
+
+  if (__atomic_sub_fetch(&sr->running, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    unsigned char b = EVENT_INDEX;
+    write(edt.ev.sigpipe[1], &b, 1);
+  }
+  return NULL;
+}
+
+void editorIndexStop()
+{
+  struct search *sr = &edt.search;
+  __atomic_store_n(&sr->cancel, 1, __ATOMIC_RELAXED);
+  for (int t = 0; t < sr->nthreads; t++)
+    pthread_join(sr->tid[t], NULL);
+  sr->nthreads = 0;
+  /* a save may map the file anew */
+  patForget(&sr->pat);
+
+  for (int k = 0; k < sr->nsegs; k++)
+  {
+    free(sr->segs[k].rows);
+    free(sr->segs[k].m);
+  }
+  free(sr->segs);
+  sr->segs = NULL;
+  sr->nsegs = 0;
+  sr->n = 0;
+  sr->ready = 0;
+}
+
+void editorIndexSegment(int row, long line, int count, erow **rows)
+{
+  struct search *sr = &edt.search;
+  if ((sr->nsegs & (sr->nsegs - 1)) == 0)
+    sr->segs = realloc(sr->segs, sizeof(struct searchseg) * (sr->nsegs ? sr->nsegs * 2 : 1));
+  struct searchseg *sg = &sr->segs[sr->nsegs++];
+  sg->row = row;
+  sg->line = line;
+  sg->count = count;
+  sg->rows = NULL;
+  if (rows)
+  {
+    sg->rows = malloc(sizeof(erow *) * count);
+    memcpy(sg->rows, rows, sizeof(erow *) * count);
+  }
+  sg->m = NULL;
+  sg->n = 0;
+  sg->cap = 0;
+}
+
+/* Cut the buffer into segments of about TERM_SEARCH_CHUNK bytes and set the
+   workers loose on them. The prompt is modal, so nothing the workers read
+   is edited or freed until editorIndexStop. */
+void editorIndexStart()
+{
+  struct search *sr = &edt.search;
+  if (sr->pat.len == 0 || sr->pat.err || edt.numrows == 0)
+    return;
+
+  int row = 0;
+  for (struct rowspan *sp = editorSpanFirst(); sp; sp = editorSpanNext(sp))
+  {
+    if (sp->line < 0)
+    {
+      editorIndexSegment(row, -1, sp->count, sp->rows);
+      row += sp->count;
+      continue;
+    }
+    long line = sp->line, end = sp->line + sp->count;
+    while (line < end)
+    {
+      long stop = line + 1;
+      long hi = end;
+      while (stop < hi)
+      {
+        long mid = stop + (hi - stop + 1) / 2;
+        if (edt.lineoff[mid] - edt.lineoff[line] <= TERM_SEARCH_CHUNK)
+          stop = mid;
+        else
+          hi = mid - 1;
+      }
+      editorIndexSegment(row, line, stop - line, NULL);
+      row += stop - line;
+      line = stop;
+    }
+  }
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu < 1 ? 1 : (ncpu > TERM_SPLIT_THREADS ? TERM_SPLIT_THREADS : ncpu);
+  if (nthreads > sr->nsegs)
+    nthreads = sr->nsegs;
+  sr->next = 0;
+  sr->cancel = 0;
+  sr->running = nthreads;
+  for (int t = 0; t < nthreads; t++)
+  {
+    if (pthread_create(&sr->tid[sr->nthreads], NULL, searchWorker, sr) == 0)
+      sr->nthreads++;
+    else
+      __atomic_sub_fetch(&sr->running, 1, __ATOMIC_ACQ_REL);
+  }
+  if (sr->nthreads == 0)
+  {
+    sr->running = 1;
+    searchWorker(sr);
+  }
+}
+
+/* Wait for the workers to finish. The matches stay in their segments,
+   which are in buffer order; each only learns the index of its first
+   match. */
+void editorIndexWait()
+{
+  struct search *sr = &edt.search;
+  for (int t = 0; t < sr->nthreads; t++)
+    pthread_join(sr->tid[t], NULL);
+  sr->nthreads = 0;
+
+  for (int k = 0; k < sr->nsegs; k++)
+  {
+    sr->segs[k].first = sr->n;
+    sr->n += sr->segs[k].n;
+  }
+  sr->ready = 1;
+}
+
+/* Called from the event loop once the workers are done. */
+void editorIndexReady()
+{
+  struct search *sr = &edt.search;
+  if (sr->nsegs == 0 || sr->ready || __atomic_load_n(&sr->running, __ATOMIC_ACQUIRE) != 0)
+    return;
+  editorIndexWait();
+  editorRefreshScreen();
+}
+
+/* Match k of the index, found by its segment. */
+struct match *editorMatch(long k)
+{
+  struct search *sr = &edt.search;
+  int lo = 0, hi = sr->nsegs - 1;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (sr->segs[mid].first <= k)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &sr->segs[lo].m[k - sr->segs[lo].first];
+}
+
+/* Index of the first match after (row, col), or n. */
+long editorMatchAfter(int row, int col)
+{
+  struct search *sr = &edt.search;
+  long lo = 0, hi = sr->n;
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    struct match *m = editorMatch(mid);
+    if (m->row < row || (m->row == row && m->col <= col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* A literal query that extends the last one only matches where the last
+   one did, so once the index for it is complete, the index for the new
+   query is made by filtering it rather than searching the buffer again.
+   Since the index skips overlapping matches, every position inside an
+   indexed match is a candidate. Regexes and whole words don't narrow that
+   way and are searched anew. */
+int editorIndexNarrow(const char *query)
+{
+  struct search *sr = &edt.search;
+  struct pattern *p = &sr->pat;
+  int old = p->len, len = strlen(query);
+  if (!sr->ready || sr->regex || sr->word || p->re || p->word || p->err || p->icase != sr->icase ||
+      old == 0 || len <= old)
+    return 0;
+  for (int i = 0; i < old; i++)
+    if (p->fold[(unsigned char)query[i]] != p->s[i])
+      return 0;
+
+  patCompile(p, query, sr->icase, 0, 0);
+  sr->n = 0;
+  for (int k = 0; k < sr->nsegs; k++)
+  {
+    struct searchseg *sg = &sr->segs[k];
+    long n = 0;
+    int row = -1, size = 0, end = 0;
+    const char *text = NULL;
+    for (long i = 0; i < sg->n; i++)
+    {
+      struct match m = sg->m[i];
+      if (m.row != row)
+      {
+        row = m.row;
+        end = 0;
+        if (sg->line < 0)
+        {
+          text = sg->rows[row - sg->row]->chars;
+          size = sg->rows[row - sg->row]->size;
+        }
+        else
+        {
+          text = &edt.map[edt.lineoff[sg->line + row - sg->row]];
+          size = editorLineLen(sg->line + row - sg->row);
+        }
+      }
+      for (int c = m.col > end ? m.col : end; c < m.col + old && c + len <= size; c++)
+        if (patAt(p, text, size, c))
+        {
+          sg->m[n].row = row;
+          sg->m[n].col = c;
+          sg->m[n].len = len;
+          n++;
+          end = c + len;
+          break;
+        }
+    }
+    sg->n = n;
+    sg->first = sr->n;
+    sr->n += n;
+  }
+  return 1;
+}
+
+void editorFindPrompt()
+{
+  snprintf(edt.search.prompt, sizeof(edt.search.prompt),
+           "%s%s%s%s: %%s (ESC/Arrows/Enter, ^T case, ^W word, ^R regex)",
+           edt.search.replace ? "Replace" : "Search", edt.search.icase ? " [i]" : "", edt.search.word ? " [w]" : "",
+           edt.search.regex ? " [re]" : "");
+}
+
+void editorFindCallback(char *query, int key)
+{
+  struct search *sr = &edt.search;
+
+  if (key == '\r' || key == '\x1b')
+  {
+    editorIndexStop();
+    sr->row = -1;
+    return;
+  }
+
+  int dir = 0;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    dir = 1;
+  else if (key == ARROW_LEFT || key == ARROW_UP)
+    dir = -1;
+  else if (key == CTRL_KEY('t'))
+    sr->icase = !sr->icase;
+  else if (key == CTRL_KEY('w'))
+    sr->word = !sr->word;
+  else if (key == CTRL_KEY('r'))
+    sr->regex = !sr->regex;
+  else if (key != BACKSPACE && key != DEL_KEY && key != CTRL_KEY('h') && key != PASTE_KEY &&
+           (iscntrl(key) || key >= 128))
+    return; /* the query is as it was: keep the index */
+  editorFindPrompt();
+
+  int len = sr->len;
+  int row = sr->row < 0 ? 0 : sr->row;
+  int col = sr->row < 0 ? 0 : sr->col;
+  if (dir && sr->ready)
+  {
+    /* with the index built, stepping is a binary search */
+    if (sr->n == 0)
+      return;
+    long k = editorMatchAfter(row, dir > 0 ? col : col - 1);
+    k = dir > 0 ? (k == sr->n ? 0 : k) : (k == 0 ? sr->n - 1 : k - 1);
+    row = editorMatch(k)->row;
+    col = editorMatch(k)->col;
+    len = editorMatch(k)->len;
+  }
+  else if (dir)
+  {
+    if (sr->row >= 0 && dir > 0)
+      col++;
+    if (!editorSearch(&sr->pat, dir, &row, &col, &len))
+      return;
+  }
+  else if (editorIndexNarrow(query))
+  {
+    /* the current match or the first one after it, as below */
+    if (sr->n == 0)
+    {
+      sr->row = -1;
+      return;
+    }
+    long k = editorMatchAfter(row, col - 1);
+    k = k == sr->n ? 0 : k;
+    row = editorMatch(k)->row;
+    col = editorMatch(k)->col;
+    len = editorMatch(k)->len;
+  }
+  else
+  {
+    /* a changed query or mode is looked for from the current match on,
+       while the index for it is built in the background */
+    editorIndexStop();
+    patCompile(&sr->pat, query, sr->icase, sr->word, sr->regex);
+    editorIndexStart();
+    if (!editorSearch(&sr->pat, 1, &row, &col, &len))
+    {
+      sr->row = -1;
+      return;
+    }
+  }
+
+  sr->row = row;
+  sr->col = col;
+  sr->len = len;
+  edt.cy = row;
+  edt.cx = col;
+  edt.rowoff = edt.numrows;
+}
+
+void editorFind()
+{
+  int saved_cx = edt.cx;
+  int saved_cy = edt.cy;
+  int saved_coloff = edt.coloff;
+  int saved_rowoff = edt.rowoff;
+  edt.search.row = -1;
+  edt.search.pat.len = 0;
+  edt.search.pat.err = NULL;
+  edt.search.active = 1;
+  editorFindPrompt();
+  char *query = editorPrompt(edt.search.prompt, editorFindCallback);
+  edt.search.active = 0;
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    edt.cx = saved_cx;
+    edt.cy = saved_cy;
+    edt.coloff = saved_coloff;
+    edt.rowoff = saved_rowoff;
   }
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(edt.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1)
+/* Rebuild every row holding a match in the index with the matches
+   replaced by with. Each row is rebuilt once, with at most one
+   reallocation, and left dirty: it is rendered and highlighted when it is
+   next shown. */
+long editorReplaceMatches(const char *with, int wlen)
+{
+  struct search *sr = &edt.search;
+  char *buf = NULL;
+  size_t cap = 0;
+  int first = -1;
+  for (int k = 0; k < sr->nsegs; k++)
   {
-    if (ftruncate(fd, len) != -1)
+    struct searchseg *sg = &sr->segs[k];
+    for (long i = 0, j; i < sg->n; i = j)
     {
-      if (write(fd, buf, len) == len)
+      int r = sg->m[i].row;
+      erow *row = editorRowAt(r);
+      size_t size = row->size;
+      for (j = i; j < sg->n && sg->m[j].row == r; j++)
+        size += wlen - sg->m[j].len;
+      if (size + 1 > cap)
       {
-        close(fd);
-        free(buf);
-        edt.unch = 0;
-        editorSetStatusMessage("%d bytes have been written to disk", len);
-        return;
+        cap = size + 1 > cap * 2 ? size + 1 : cap * 2;
+        buf = realloc(buf, cap);
+      }
+
+      size_t out = 0;
+      int at = 0;
+      for (long x = i; x < j; x++)
+      {
+        struct match *m = &sg->m[x];
+        memcpy(&buf[out], &row->chars[at], m->col - at);
+        out += m->col - at;
+        memcpy(&buf[out], with, wlen);
+        out += wlen;
+        at = m->col + m->len;
       }
+      memcpy(&buf[out], &row->chars[at], row->size - at);
+      undoRecord(UNDO_SET, r, 0, row->chars, row->size, buf, size);
+
+      editorRowReserve(row, size);
+      memcpy(row->chars, buf, size);
+      row->chars[size] = '\0';
+      row->size = size;
+      row->dirty = 1;
+      if (first < 0)
+        first = r;
     }
-    close(fd);
   }
   free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-}
 
-// search func
+  if (first >= 0)
+  {
+    if (first < edt.dirty_from)
+      edt.dirty_from = first;
+    editorTouch(first);
+  }
+  return sr->n;
+}
 
-void editorFindCallback(char *query, int key)
+void indexProgress()
 {
-  static int last_match = -1;
-  static int direction = 1;
-
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+  struct search *sr = &edt.search;
+  int done = __atomic_load_n(&sr->next, __ATOMIC_RELAXED);
+  if (done > sr->nsegs)
+    done = sr->nsegs;
+  editorSetStatusMessage("Finding matches: %d%% (ESC cancels)", sr->nsegs ? done * 100 / sr->nsegs : 100);
+  timerCancel(&edt.ev.status);
+  editorRefreshScreen();
+  timerSet(&edt.ev.progress, TERM_PROGRESS_MS, indexProgress);
+}
 
-  if (saved_hl)
+/* Wait for the index build while still reading input, showing how far it
+   got. ESC stops it; other keys stay queued for after. Returns 0 if
+   stopped. */
+int editorIndexWaitKeys()
+{
+  struct search *sr = &edt.search;
+  timerSet(&edt.ev.progress, TERM_PROGRESS_MS, indexProgress);
+  while (!sr->ready && sr->nsegs)
   {
-    memcpy(edt.row[saved_hl_line].hl, saved_hl, edt.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+    editorWaitEvent();
+    if (inputTake(&edt.in, '\x1b'))
+    {
+      timerCancel(&edt.ev.progress);
+      editorIndexStop();
+      return 0;
+    }
   }
+  timerCancel(&edt.ev.progress);
+  return 1;
+}
 
-  if (key == '\r' || key == '\x1b')
-  {
-    last_match = -1;
-    direction = 1;
+/* Replace all matches of a query, typed as for a search, at once: the
+   index workers find them all first, then the rows are rewritten. */
+void editorReplace()
+{
+  struct search *sr = &edt.search;
+  int saved_cx = edt.cx;
+  int saved_cy = edt.cy;
+  int saved_coloff = edt.coloff;
+  int saved_rowoff = edt.rowoff;
+  sr->row = -1;
+  sr->pat.len = 0;
+  sr->pat.err = NULL;
+  sr->active = 1;
+  sr->replace = 1;
+  editorFindPrompt();
+  char *query = editorPrompt(sr->prompt, editorFindCallback);
+  sr->active = 0;
+  sr->replace = 0;
+  edt.cx = saved_cx;
+  edt.cy = saved_cy;
+  edt.coloff = saved_coloff;
+  edt.rowoff = saved_rowoff;
+  if (query == NULL)
     return;
-  }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  free(query);
+  if (sr->pat.err)
   {
-    direction = 1;
+    editorSetStatusMessage("Bad regex: %s", sr->pat.err);
+    return;
   }
-  else if (key == ARROW_LEFT || key == ARROW_UP)
+
+  char *with = editorPromptText("Replace with: %s", NULL, 1);
+  if (with == NULL)
   {
-    direction = -1;
+    editorSetStatusMessage("Replace aborted");
+    return;
   }
-  else
+
+  long start = editorNowMs();
+  editorIndexStart();
+  if (!editorIndexWaitKeys())
   {
-    last_match = -1;
-    direction = 1;
-  }
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < edt.numrows; i++)
-  {
-    current += direction;
-    if (current == -1)
-      current = edt.numrows - 1;
-    else if (current == edt.numrows)
-      current = 0;
-    erow *row = &edt.row[current];
-    char *match = strstr(row->render, query);
-    if (match)
-    {
-      last_match = current;
-      edt.cy = current;
-      edt.cx = editorRowRxtoCx(row, match - row->render);
-      edt.rowoff = edt.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+    free(with);
+    editorSetStatusMessage("Replace cancelled");
+    return;
   }
+  long n = editorReplaceMatches(with, strlen(with));
+  editorIndexStop();
+  free(with);
+
+  erow *row = editorRowAt(edt.cy);
+  if (row && edt.cx > row->size)
+    edt.cx = row->size;
+  editorSetStatusMessage("Replaced %ld matches in %ld ms", n, editorNowMs() - start);
 }
 
-void editorFind()
+void editorOpenPrompt()
 {
-  int saved_cx = edt.cx;
-  int saved_cy = edt.cy;
-  int saved_coloff = edt.coloff;
-  int saved_rowoff = edt.rowoff;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
-  if (query)
+  if (edt.unch)
   {
-    free(query);
+    editorSetStatusMessage("File has unsaved changes, save them before opening another");
+    return;
   }
-  else
+
+  char *filename = editorPrompt("Open: %s", NULL);
+  if (filename == NULL)
   {
-    edt.cx = saved_cx;
-    edt.cy = saved_cy;
-    edt.coloff = saved_coloff;
-    edt.rowoff = saved_rowoff;
+    editorSetStatusMessage("Open Aborted");
+    return;
+  }
+  if (access(filename, R_OK) != 0)
+  {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    free(filename);
+    return;
   }
+
+  editorCloseBuffer();
+  editorOpen(filename);
+  free(filename);
 }
 
 // input
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+/* Read a line of input on the status bar; with empty set, Enter accepts
+   an empty line too. */
+char *editorPromptText(char *prompt, void (*callback)(char *, int), int empty)
 {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
@@ -894,8 +5315,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
   while (1)
   {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
-    int c = editorReadKey();
+    timerCancel(&edt.ev.status);
+    editorCoalesceRefresh();
+    int c = KEY_BASE(editorReadKey());
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
     {
       if (buflen != 0)
@@ -909,9 +5331,26 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
       free(buf);
       return NULL;
     }
+    else if (c == PASTE_KEY)
+    {
+      for (int j = 0; j < edt.in.paste.len && edt.in.paste.b[j] != '\r' && edt.in.paste.b[j] != '\n'; j++)
+      {
+        unsigned char pc = edt.in.paste.b[j];
+        if (pc >= 128 || iscntrl(pc))
+          continue;
+        if (buflen == bufsize - 1)
+        {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = pc;
+        buf[buflen] = '\0';
+      }
+      edt.in.paste.len = 0;
+    }
     else if (c == '\r')
     {
-      if (buflen != 0)
+      if (buflen != 0 || empty)
       {
         editorSetStatusMessage("");
         if (callback)
@@ -934,10 +5373,15 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
   }
 }
 
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
+{
+  return editorPromptText(prompt, callback, 0);
+}
+
 void editorMoveCursor(int key)
 {
 
-  erow *row = (edt.cy >= edt.numrows) ? NULL : &edt.row[edt.cy];
+  erow *row = (edt.cy >= edt.numrows) ? NULL : editorRowAt(edt.cy);
 
   switch (key)
   {
@@ -947,7 +5391,7 @@ void editorMoveCursor(int key)
     else if (edt.cy > 0)
     {
       edt.cy--;
-      edt.cx = edt.row[edt.cy].size;
+      edt.cx = editorRowAt(edt.cy)->size;
     }
     break;
   case ARROW_RIGHT:
@@ -974,7 +5418,7 @@ void editorMoveCursor(int key)
     else if (edt.cy > 0)
     {
       edt.cy--;
-      edt.cx = edt.row[edt.cy].size;
+      edt.cx = editorRowAt(edt.cy)->size;
     }
     break;
   case 'l':
@@ -996,7 +5440,7 @@ void editorMoveCursor(int key)
     break;
   }
 
-  row = (edt.cy >= edt.numrows) ? NULL : &edt.row[edt.cy];
+  row = (edt.cy >= edt.numrows) ? NULL : editorRowAt(edt.cy);
   int rowlen = row ? row->size : 0;
   if (edt.cx > rowlen)
     edt.cx = rowlen;
@@ -1007,7 +5451,8 @@ void editorProcessKeypress()
 
   static int quit_times = TERM_QUIT_TIMES;
 
-  int c = editorReadKey();
+  int c = KEY_BASE(editorReadKey());
+  undoKey();
   switch (c)
   {
 
@@ -1015,6 +5460,11 @@ void editorProcessKeypress()
     editorInsertNewLine();
     break;
 
+  case PASTE_KEY:
+    editorInsertText(edt.in.paste.b, edt.in.paste.len);
+    edt.in.paste.len = 0;
+    break;
+
   case CTRL_KEY('q'):
 
     if (edt.unch && quit_times > 0)
@@ -1026,6 +5476,7 @@ void editorProcessKeypress()
       return;
     }
 
+    journalClose(0);
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     exit(0);
@@ -1047,12 +5498,24 @@ void editorProcessKeypress()
     editorFind();
     break;
 
+  case CTRL_KEY('\\'):
+    editorReplace();
+    break;
+
+  case CTRL_KEY('o'):
+    editorOpenPrompt();
+    break;
+
+  case CTRL_KEY('r'):
+    editorRedo();
+    break;
+
   case HOME_KEY:
     edt.cx = 0;
     break;
   case END_KEY:
-    if (edt.cx < edt.numrows)
-      edt.cx = edt.row[edt.cy].size;
+    if (edt.cy < edt.numrows)
+      edt.cx = editorRowAt(edt.cy)->size;
     break;
 
   case BACKSPACE:
@@ -1124,6 +5587,18 @@ void editorProcessKeypress()
             }
             break;
 
+          case 'M':
+            editorSetStatusMessage("rows: %zu KB live / %zu KB reserved | frame: %d bytes, %d writes",
+                                   edt.pool.live / 1024, edt.pool.reserved / 1024,
+                                   edt.frame.bytes, edt.frame.writes);
+            prev = '\0';
+            break;
+
+          case 'u':
+            editorUndo();
+            prev = '\0';
+            break;
+
           default:
             prev = c;
             break;
@@ -1141,10 +5616,178 @@ void editorProcessKeypress()
   }
 
   quit_times = TERM_QUIT_TIMES;
+
+  if (TERM_AUTOSAVE_MS && edt.unch && edt.filename && !edt.ev.autosave.armed)
+    timerSet(&edt.ev.autosave, TERM_AUTOSAVE_MS, autosaveFire);
 }
 
 // file handling
 
+struct splitjob
+{
+  const char *buf;
+  size_t start;
+  size_t end;
+
+  size_t *offs;
+  size_t count;
+  size_t cap;
+  long raw;
+};
+
+void splitPush(struct splitjob *job, size_t off)
+{
+  if (job->count == job->cap)
+  {
+    job->cap *= 2;
+    job->offs = realloc(job->offs, sizeof(size_t) * job->cap);
+  }
+  job->offs[job->count++] = off;
+}
+
+/* Record the line ended by the '\n' at nl, noting the first one that a save
+   would not write back verbatim because it ends in '\r'. */
+void splitLine(struct splitjob *job, size_t nl)
+{
+  if (job->raw < 0 && nl > 0 && job->buf[nl - 1] == '\r')
+    job->raw = job->count;
+  splitPush(job, nl + 1);
+}
+
+/* Record the offset just past every '\n' in buf[start, end). */
+void *splitWorker(void *arg)
+{
+  struct splitjob *job = arg;
+  const char *buf = job->buf;
+  size_t i = job->start;
+
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 64 <= job->end; i += 64)
+  {
+    const __m128i *v = (const __m128i *)&buf[i];
+    unsigned long long mask =
+        (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v), nl)) |
+        (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 1), nl)) << 16 |
+        (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 2), nl)) << 32 |
+        (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 3), nl)) << 48;
+    while (mask)
+    {
+      splitLine(job, i + __builtin_ctzll(mask));
+      mask &= mask - 1;
+    }
+  }
+#else
+  const char *p;
+  while (i < job->end && (p = memchr(&buf[i], '\n', job->end - i)) != NULL)
+  {
+    splitLine(job, p - buf);
+    i = (size_t)(p - buf) + 1;
+  }
+  i = job->end;
+#endif
+  for (; i < job->end; i++)
+  {
+    if (buf[i] == '\n')
+      splitLine(job, i);
+  }
+  return NULL;
+}
+
+/* Build the line offset index of buf, scanning chunks of it in parallel and
+   stitching the per-chunk results together in order. lineoff gets nlines + 1
+   entries, the last being len. rawline is the first line a save would not
+   write back byte for byte (or nlines). */
+long editorSplitLines(const char *buf, size_t len, size_t **lineoff, long *rawline)
+{
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = len / TERM_SPLIT_CHUNK;
+  if (nthreads > ncpu)
+    nthreads = ncpu;
+  if (nthreads > TERM_SPLIT_THREADS)
+    nthreads = TERM_SPLIT_THREADS;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  struct splitjob jobs[TERM_SPLIT_THREADS];
+  pthread_t tid[TERM_SPLIT_THREADS];
+  int started[TERM_SPLIT_THREADS];
+  for (int t = 0; t < nthreads; t++)
+  {
+    jobs[t].buf = buf;
+    jobs[t].start = len / nthreads * t;
+    jobs[t].end = (t == nthreads - 1) ? len : len / nthreads * (t + 1);
+    jobs[t].count = 0;
+    jobs[t].raw = -1;
+    jobs[t].cap = (jobs[t].end - jobs[t].start) / 64 + 16;
+    jobs[t].offs = malloc(sizeof(size_t) * jobs[t].cap);
+    if (t == 0 && len > 0)
+      jobs[t].offs[jobs[t].count++] = 0;
+    started[t] = t > 0 && pthread_create(&tid[t], NULL, splitWorker, &jobs[t]) == 0;
+  }
+  for (int t = 0; t < nthreads; t++)
+  {
+    if (started[t])
+      pthread_join(tid[t], NULL);
+    else
+      splitWorker(&jobs[t]);
+  }
+
+  /* the first chunk's array becomes the index, the others are appended */
+  size_t total = 0;
+  for (int t = 0; t < nthreads; t++)
+    total += jobs[t].count;
+
+  size_t *off = realloc(jobs[0].offs, sizeof(size_t) * (total + 1));
+  long nlines = jobs[0].count;
+  long raw = jobs[0].raw >= 0 ? jobs[0].raw - 1 : -1;
+  for (int t = 1; t < nthreads; t++)
+  {
+    if (raw < 0 && jobs[t].raw >= 0)
+      raw = nlines + jobs[t].raw - 1;
+    memcpy(&off[nlines], jobs[t].offs, sizeof(size_t) * jobs[t].count);
+    nlines += jobs[t].count;
+    free(jobs[t].offs);
+  }
+  if (nlines > 0 && off[nlines - 1] == len)
+    nlines--;
+  off[nlines] = len;
+  if (len > 0 && buf[len - 1] != '\n' && (raw < 0 || raw > nlines - 1))
+    raw = nlines - 1;
+
+  *lineoff = off;
+  *rawline = raw >= 0 ? raw : nlines;
+  return nlines;
+}
+
+/* Large files are mapped rather than read: only an index of line offsets is
+   built here and rows are materialized by editorRowAt when first touched. */
+int editorOpenMapped(int fd, size_t len)
+{
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, len, MADV_WILLNEED);
+
+  size_t *lineoff;
+  long rawline;
+  long nlines = editorSplitLines(map, len, &lineoff, &rawline);
+
+  edt.map = map;
+  edt.maplen = len;
+  edt.lineoff = lineoff;
+  edt.nlines = nlines;
+  edt.rawline = rawline;
+  fstat(fd, &edt.mapstat);
+
+  if (nlines > 0)
+  {
+    editorSpanInsert(edt.numrows, editorSpanNew(0, nlines));
+    edt.numrows += nlines;
+  }
+  return 0;
+}
+
 void editorOpen(char *filename)
 {
 
@@ -1157,20 +5800,40 @@ void editorOpen(char *filename)
   if (!fp)
     terminate("fopen");
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= TERM_MMAP_THRESHOLD &&
+      editorOpenMapped(fileno(fp), st.st_size) == 0)
+  {
+    fclose(fp);
+    edt.unch = 0;
+    edt.edit_from = edt.numrows;
+    journalOpen();
+    return;
+  }
+
+  size_t cap = 4096;
+  size_t len = 0;
+  size_t nread;
+  char *buf = malloc(cap);
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  while ((nread = fread(&buf[len], 1, cap - len, fp)) > 0)
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(edt.numrows, line, linelen);
+    len += nread;
+    if (len == cap)
+    {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
   }
+  edt.undo.off++;
+  editorInsertRows(edt.numrows, buf, len);
+  edt.undo.off--;
 
-  free(line);
+  free(buf);
   fclose(fp);
   edt.unch = 0;
+  edt.edit_from = edt.numrows;
+  journalOpen();
 }
 
 // output
@@ -1181,14 +5844,17 @@ void editorSetStatusMessage(const char *fmt, ...)
   va_start(ap, fmt);
   vsnprintf(edt.statusmsg, sizeof(edt.statusmsg), fmt, ap);
   va_end(ap);
-  edt.statusmsg_time = time(NULL);
+  if (edt.statusmsg[0])
+    timerSet(&edt.ev.status, TERM_STATUS_MS, statusExpire);
+  else
+    timerCancel(&edt.ev.status);
 }
 void editorScroll()
 {
   edt.rx = 0;
   if (edt.cy < edt.numrows)
   {
-    edt.rx = editorRowCxtoRx(&edt.row[edt.cy], edt.cx);
+    edt.rx = editorRowCxtoRx(editorRowAt(edt.cy), edt.cx);
   }
 
   if (edt.cy < edt.rowoff)
@@ -1209,7 +5875,204 @@ void editorScroll()
   }
 }
 
-void editorDrawRows(struct abuf *ab)
+void framePut(int y, int x, char ch, unsigned char attr)
+{
+  if (x < 0 || x >= edt.frame.cols)
+    return;
+  edt.frame.next.ch[y * edt.frame.cols + x] = ch;
+  edt.frame.next.attr[y * edt.frame.cols + x] = attr;
+}
+
+void frameText(int y, int x, const char *s, int len, unsigned char attr)
+{
+  if (x < 0 || len <= 0)
+    return;
+  if (len > edt.frame.cols - x)
+    len = edt.frame.cols - x;
+  memcpy(&edt.frame.next.ch[y * edt.frame.cols + x], s, len);
+  memset(&edt.frame.next.attr[y * edt.frame.cols + x], attr, len);
+}
+
+/* Make the grids match the terminal size and clear the next frame. A resize
+   drops the retained frame so the next flush redraws every cell. */
+void frameBegin(int rows, int cols)
+{
+  size_t cells = (size_t)rows * cols;
+  if (rows != edt.frame.rows || cols != edt.frame.cols)
+  {
+    free(edt.frame.cur.ch);
+    free(edt.frame.cur.attr);
+    free(edt.frame.next.ch);
+    free(edt.frame.next.attr);
+    edt.frame.rows = rows;
+    edt.frame.cols = cols;
+    edt.frame.cur.ch = calloc(cells, 1);
+    edt.frame.cur.attr = calloc(cells, 1);
+    edt.frame.next.ch = malloc(cells);
+    edt.frame.next.attr = malloc(cells);
+  }
+  memset(edt.frame.next.ch, ' ', cells);
+  memset(edt.frame.next.attr, 0, cells);
+}
+
+/* Forget what is on screen so the next flush redraws every row. */
+void frameInvalidate()
+{
+  if (edt.frame.cur.ch)
+    memset(edt.frame.cur.ch, 0, (size_t)edt.frame.rows * edt.frame.cols);
+}
+
+void frameAttr(struct abuf *ab, int *cur, unsigned char attr)
+{
+  if (*cur == attr)
+    return;
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "\x1b[0%s", (attr & ATTR_REVERSE) ? ";7" : "");
+  if (attr & ATTR_COLOUR)
+    len += snprintf(&buf[len], sizeof(buf) - len, ";%d", 30 + (attr & ATTR_COLOUR));
+  buf[len++] = 'm';
+  abAppend(ab, buf, len);
+  *cur = attr;
+}
+
+void frameMove(struct abuf *ab, int y, int x)
+{
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+/* Emit cells [from, to) of a row, one copy per run of equal attributes. */
+void frameCells(struct abuf *ab, int *attr, char *ch, unsigned char *at, int from, int to)
+{
+  while (from < to)
+  {
+    int end = from + 1;
+    while (end < to && at[end] == at[from])
+      end++;
+    frameAttr(ab, attr, at[from]);
+    abAppend(ab, &ch[from], end - from);
+    from = end;
+  }
+}
+
+/* Emit only the cells that differ from the retained frame: each changed run
+   gets a cursor move, short unchanged gaps are rewritten rather than skipped,
+   and a changed blank tail becomes a single erase. Rows holding bytes outside
+   ASCII are redrawn whole, since their bytes and columns need not line up.
+   Returns whether anything was emitted. */
+int frameFlush(struct abuf *ab)
+{
+  int rows = edt.frame.rows, cols = edt.frame.cols;
+  int start = ab->len;
+  int attr = -1;
+  int py = -1, px = -1;
+
+  for (int y = 0; y < rows; y++)
+  {
+    char *nc = &edt.frame.next.ch[y * cols];
+    unsigned char *na = &edt.frame.next.attr[y * cols];
+    char *cc = &edt.frame.cur.ch[y * cols];
+    unsigned char *ca = &edt.frame.cur.attr[y * cols];
+
+    if (memcmp(nc, cc, cols) == 0 && memcmp(na, ca, cols) == 0)
+      continue;
+
+    int blank = cols;
+    while (blank > 0 && nc[blank - 1] == ' ' && na[blank - 1] == 0)
+      blank--;
+
+    int whole = 0;
+    for (int x = 0; x < cols && !whole; x++)
+      whole = (nc[x] & 0x80) || (cc[x] & 0x80) || cc[x] == 0;
+
+    if (whole)
+    {
+      frameMove(ab, y, 0);
+      frameCells(ab, &attr, nc, na, 0, blank);
+      if (blank < cols)
+      {
+        frameAttr(ab, &attr, 0);
+        abAppend(ab, "\x1b[K", 3);
+      }
+      py = -1;
+      continue;
+    }
+
+    int x = 0;
+    while (x < cols)
+    {
+      if (nc[x] == cc[x] && na[x] == ca[x])
+      {
+        x++;
+        continue;
+      }
+
+      if (py != y || px != x)
+        frameMove(ab, y, x);
+      if (x >= blank)
+      {
+        frameAttr(ab, &attr, 0);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+
+      int end = x + 1;
+      for (int j = end, gap = 0; j < blank && gap <= 4; j++)
+      {
+        if (nc[j] == cc[j] && na[j] == ca[j])
+          gap++;
+        else
+        {
+          end = j + 1;
+          gap = 0;
+        }
+      }
+      frameCells(ab, &attr, nc, na, x, end);
+      x = end;
+      py = y;
+      px = end < cols ? end : -1;
+    }
+  }
+  if (attr > 0)
+    abAppend(ab, "\x1b[m", 3);
+
+  struct grid t = edt.frame.cur;
+  edt.frame.cur = edt.frame.next;
+  edt.frame.next = t;
+  return ab->len != start;
+}
+
+void editorDrawMatch(struct match *m)
+{
+  erow *row = editorRowRendered(m->row);
+  int from = editorRowCxtoRx(row, m->col) - edt.coloff;
+  int to = editorRowCxtoRx(row, m->col + m->len) - edt.coloff;
+  int y = m->row - edt.rowoff;
+  for (int x = from < 0 ? 0 : from; x < to && x < edt.screencols; x++)
+    edt.frame.next.attr[y * edt.frame.cols + x] = editorSyntaxToColour(HL_MATCH) - 30;
+}
+
+/* While searching, every match on screen is highlighted, taken straight
+   from the index; until that is built only the current match is. */
+void editorDrawMatches()
+{
+  struct search *sr = &edt.search;
+  if (!sr->active || sr->pat.len == 0)
+    return;
+  if (sr->ready)
+  {
+    for (long k = editorMatchAfter(edt.rowoff, -1); k < sr->n && editorMatch(k)->row < edt.rowoff + edt.screenrows; k++)
+      editorDrawMatch(editorMatch(k));
+  }
+  else if (sr->row >= edt.rowoff && sr->row < edt.rowoff + edt.screenrows)
+  {
+    struct match m = {sr->row, sr->col, sr->len};
+    editorDrawMatch(&m);
+  }
+}
+
+void editorDrawRows()
 {
   int y;
   for (y = 0; y < edt.screenrows; y++)
@@ -1217,6 +6080,7 @@ void editorDrawRows(struct abuf *ab)
     int filerow = y + edt.rowoff;
     if (filerow >= edt.numrows)
     {
+      framePut(y, 0, '~', 0);
       if (y == edt.screenrows / 3 && edt.numrows == 0)
       {
         char welcome[80];
@@ -1226,117 +6090,76 @@ void editorDrawRows(struct abuf *ab)
           welcomelen = edt.screencols;
 
         int padding = (edt.screencols - welcomelen) / 2;
-        if (padding)
-        {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      }
-      else
-      {
-        abAppend(ab, "~", 1);
+        frameText(y, padding, welcome, welcomelen, 0);
       }
     }
     else
     {
-      int len = edt.row[filerow].rsize - edt.coloff;
+      erow *row = editorRowRendered(filerow);
+      int len = row->rsize - edt.coloff;
       if (len < 0)
         len = 0;
       if (len > edt.screencols)
         len = edt.screencols;
-      char *c = &edt.row[filerow].render[edt.coloff];
-      unsigned char *hl = &edt.row[filerow].hl[edt.coloff];
-      int current_colour = -1;
+      char *c = &row->render[edt.coloff];
+      unsigned char *hl = &row->hl[edt.coloff];
+      frameText(y, 0, c, len, 0);
       int j;
       for (j = 0; j < len; j++)
       {
         if (iscntrl(c[j]))
-        {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_colour != -1)
-          {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_colour);
-            abAppend(ab, buf, clen);
-          }
-        }
-
-        else if (hl[j] == HL_NORMAL)
-        {
-          if (current_colour != -1)
-          {
-            abAppend(ab, "\x1b[39m", 5);
-            current_colour = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        }
-        else
-        {
-          int colour = editorSyntaxToColour(hl[j]);
-          if (colour != current_colour)
-          {
-            current_colour = colour;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
+          framePut(y, j, (c[j] <= 26) ? '@' + c[j] : '?', ATTR_REVERSE);
+        else if (hl[j] != HL_NORMAL)
+          edt.frame.next.attr[y * edt.frame.cols + j] = editorSyntaxToColour(hl[j]) - 30;
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
+  editorDrawMatches();
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar()
 {
-  abAppend(ab, "\x1b[K", 3);
   int msglen = strlen(edt.statusmsg);
   if (msglen > edt.screencols)
     msglen = edt.screencols;
-  if (msglen && time(NULL) - edt.statusmsg_time < 5)
-    abAppend(ab, edt.statusmsg, msglen);
+  if (msglen)
+    frameText(edt.screenrows + 1, 0, edt.statusmsg, msglen, 0);
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar()
 {
-  abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
+  int y = edt.screenrows;
 
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                      edt.filename ? edt.filename : "[No Name]", edt.numrows,
                      edt.unch ? ("modified") : "");
 
+  struct search *sr = &edt.search;
+  if (sr->active && sr->pat.len && sr->pat.err)
+    len += snprintf(&status[len], sizeof(status) - len, " | %s", sr->pat.err);
+  else if (sr->active && sr->pat.len && !sr->ready)
+    len += snprintf(&status[len], sizeof(status) - len, " | counting matches");
+  else if (sr->active && sr->pat.len && sr->n == 0)
+    len += snprintf(&status[len], sizeof(status) - len, " | no matches");
+  else if (sr->active && sr->pat.len && sr->row < 0)
+    len += snprintf(&status[len], sizeof(status) - len, " | %ld match%s", sr->n, sr->n == 1 ? "" : "es");
+  else if (sr->active && sr->pat.len)
+    len += snprintf(&status[len], sizeof(status) - len, " | match %ld of %ld",
+                    editorMatchAfter(sr->row, sr->col - 1) + 1, sr->n);
+  if (len > (int)sizeof(status) - 1)
+    len = sizeof(status) - 1;
+
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d  | %s", edt.syntax ? edt.syntax->filetype : "no ft", edt.cy + 1, edt.numrows, NORMAL_MODE ? "NORMAL MODE " : "INSERT MODE ");
 
+  for (int x = 0; x < edt.screencols; x++)
+    framePut(y, x, ' ', ATTR_REVERSE);
+
   if (len > edt.screencols)
     len = edt.screencols;
-  abAppend(ab, status, len);
-
-  while (len < edt.screencols)
-  {
-    if (edt.screencols - len == rlen)
-    {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-    else
-    {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  frameText(y, 0, status, len, ATTR_REVERSE);
+  if (edt.screencols - len >= rlen)
+    frameText(y, edt.screencols - rlen, rstatus, rlen, ATTR_REVERSE);
 }
 
 void editorRefreshScreen()
@@ -1344,26 +6167,54 @@ void editorRefreshScreen()
 
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
-
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+  frameBegin(edt.screenrows + 2, edt.screencols);
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  struct abuf *ab = &edt.out;
+  abAppend(ab, "\x1b[?25l", 6);
+  int changed = frameFlush(ab);
+  if (!changed)
+    ab->len = 0;
 
   char buf[32];
   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (edt.cy - edt.rowoff) + 1, (edt.rx - edt.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  abAppend(ab, buf, strlen(buf));
 
-  abAppend(&ab, "\x1b[?25h", 6);
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  if (changed)
+    abAppend(ab, "\x1b[?25h", 6);
+  edt.frame.bytes = ab->len;
+  edt.frame.writes = abFlush(ab, STDOUT_FILENO);
+  edt.frame.drawn = editorNowMs();
 }
 
 // Main edit loop
 
+/* Whether a key is queued, part of one is buffered, or the terminal has
+   input ready within ms milliseconds. */
+int editorInputPending(int ms)
+{
+  if (edt.in.count || edt.in.len)
+    return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, ms) > 0;
+}
+
+/* Draw a frame only once all pending input has been handled. A key on its
+   own is drawn at once; only when the last frame went out less than
+   1 / TERM_MAX_FPS ago is the draw held back for the rest of that interval,
+   so that keys arriving meanwhile are folded into the same frame. */
+void editorCoalesceRefresh()
+{
+  if (editorInputPending(0))
+    return;
+  long wait = TERM_MAX_FPS ? 1000 / TERM_MAX_FPS - (editorNowMs() - edt.frame.drawn) : 0;
+  if (wait > 0 && editorInputPending(wait))
+    return;
+  editorRefreshScreen();
+}
+
 void initEditor()
 {
   edt.cx = 0;
@@ -1372,13 +6223,31 @@ void initEditor()
   edt.rowoff = 0;
   edt.coloff = 0;
   edt.numrows = 0;
-  edt.row = NULL;
+  edt.rope = NULL;
+  edt.map = NULL;
+  edt.maplen = 0;
+  edt.lineoff = NULL;
+  edt.nlines = 0;
+  edt.rawline = 0;
+  edt.edit_from = 0;
+  memset(&edt.pool, 0, sizeof(struct rowpool));
+  memset(&edt.frame, 0, sizeof(struct frame));
+  edt.out = (struct abuf)ABUF_INIT;
+  edt.in.len = edt.in.head = edt.in.count = 0;
+  edt.in.pasting = 0;
+  edt.in.paste = (struct abuf)ABUF_INIT;
+  memset(&edt.search, 0, sizeof(struct search));
+  edt.search.row = -1;
+  memset(&edt.undo, 0, sizeof(struct undolog));
+  memset(&edt.journal, 0, sizeof(struct journal));
+  edt.journal.fd = -1;
   edt.unch = 0;
   edt.filename = NULL;
   edt.statusmsg[0] = '\0';
-  edt.statusmsg_time = 0;
   edt.syntax = NULL;
 
+  editorInitEvents();
+
   if (getWindowSize(&edt.screenrows, &edt.screencols) == -1)
     terminate("getWindowSize");
 
@@ -1395,11 +6264,12 @@ int main(int argc, char *argv[])
     editorOpen(argv[1]);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find");
+  if (edt.statusmsg[0] == '\0')
+    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find | Ctrl-O = open");
 
   while (1)
   {
-    editorRefreshScreen();
+    editorCoalesceRefresh();
     editorProcessKeypress();
   }
 
@@ -0,0 +1,48 @@
+/* Regex search regressions. Built against the editor's single source file
+   with its main renamed. */
+#define main termtext_main
+#include "../TermText.c"
+#undef main
+
+/* Walk every match of query in buf and check it is at k * step + off with
+   length mlen, and that the walk is quick. */
+int checkMatches(const char *query, const char *buf, size_t len, long want, int step, int off, int mlen)
+{
+  struct pattern p = {0};
+  patCompile(&p, query, 0, 0, 1);
+  long start = editorNowMs();
+  long n = 0;
+  int l;
+  for (long m = patFind(&p, NULL, buf, len, 0, &l); m >= 0; m = patFind(&p, NULL, buf, len, m + (l ? l : 1), &l))
+  {
+    if (m != n * step + off || l != mlen)
+    {
+      fprintf(stderr, "%s: match %ld at %ld length %d\n", query, n, m, l);
+      return 1;
+    }
+    n++;
+  }
+  long ms = editorNowMs() - start;
+  if (n != want || ms > 2000)
+  {
+    fprintf(stderr, "%s: %ld matches in %ld ms, want %ld\n", query, n, ms, want);
+    return 1;
+  }
+  return 0;
+}
+
+int main()
+{
+  /* one 200,000 byte line with 50,000 matches */
+  size_t len = 200000;
+  char *buf = malloc(len);
+  for (size_t i = 0; i < len; i += 4)
+    memcpy(&buf[i], "x12 ", 4);
+
+  int failed = 0;
+  failed |= checkMatches("[0-9]+", buf, len, 50000, 4, 1, 2);
+  failed |= checkMatches("[a-z]1[0-9]", buf, len, 50000, 4, 0, 3);
+  failed |= checkMatches("1[0-9] ", buf, len, 50000, 4, 1, 3);
+  free(buf);
+  return failed;
+}
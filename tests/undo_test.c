@@ -0,0 +1,77 @@
+/* Undo grouping regressions. Built against the editor's single source file
+   with its main renamed. */
+#define main termtext_main
+#include "../TermText.c"
+#undef main
+
+/* Start a buffer holding one empty row, in insert mode. */
+void setup()
+{
+  editorCloseBuffer();
+  editorInsertRow(0, "", 0);
+  undoReset();
+  edt.cx = edt.cy = 0;
+  INSERT_MODE = true;
+  NORMAL_MODE = false;
+}
+
+/* Feed keys through the keypress handler as if they were typed. */
+void type(const int *keys, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    inputPush(&edt.in, keys[i]);
+    editorProcessKeypress();
+  }
+}
+
+/* Undo once and check what is left of the first row. */
+int checkUndo(const char *name, const char *want)
+{
+  editorUndo();
+  int len = 0;
+  const char *text = editorRowText(0, &len);
+  if (len != (int)strlen(want) || memcmp(text, want, len))
+  {
+    fprintf(stderr, "%s: undo left \"%.*s\", want \"%s\"\n", name, len, text, want);
+    return 1;
+  }
+  return 0;
+}
+
+int main()
+{
+  edt.journal.fd = -1;
+  edt.screenrows = 20;
+  edt.screencols = 80;
+  editorInitEvents();
+  int failed = 0;
+
+  /* a run of typing undoes at once */
+  int run[] = {'a', 'b', 'c'};
+  setup();
+  type(run, 3);
+  failed |= checkUndo("run", "");
+
+  /* moving away and back ends the run, even on the same row */
+  int moved[] = {'a', 'b', ARROW_LEFT, ARROW_RIGHT, 'c', 'd'};
+  setup();
+  type(moved, 6);
+  failed |= checkUndo("moved", "ab");
+  failed |= checkUndo("moved", "");
+
+  /* so does moving and typing somewhere else on the row */
+  int elsewhere[] = {'a', 'b', HOME_KEY, 'c'};
+  setup();
+  type(elsewhere, 4);
+  failed |= checkUndo("elsewhere", "ab");
+
+  /* deleting back over typing after a move is its own group too */
+  int erase[] = {'a', 'b', 'c', ARROW_LEFT, ARROW_RIGHT, BACKSPACE, BACKSPACE};
+  setup();
+  type(erase, 7);
+  failed |= checkUndo("erase", "abc");
+  failed |= checkUndo("erase", "");
+
+  return failed;
+}